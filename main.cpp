@@ -1,29 +1,52 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <glm/glm.hpp>
 #include <iostream>
+#include <random>
+#include <thread>
 
+#include "physics/checkpoint.hpp"
 #include "physics/physics.hpp"
+#include "physics/trajectory_writer.hpp"
 // #include "renderer/compute_shader.hpp"
+#include "renderer/frame_capture.hpp"
+#include "renderer/radix_sort.hpp"
 #include "renderer/renderer.hpp"
+#include "renderer/software_renderer.hpp"
 
 void framebufferSizeCallback(GLFWwindow *window, int width, int height);
+void scrollCallback(GLFWwindow *window, double x_offset, double y_offset);
 void processInput(GLFWwindow *window);
+void benchmarkRadixSort();
+void benchmarkRendering(const glm::vec2 screen_size);
+void benchmarkSoftwareRendering(const glm::vec2 screen_size,
+                                const char *output_path);
 
 float sinFluc(float minSize, float maxSize, float seed) {
   float sizeRange = maxSize - minSize;
   return sizeRange * (0.5f * (float)sin(seed) + 0.5f) + minSize;
 }
 
-int main() {
+int main(int argc, char **argv) {
   glm::vec2 screen_size(1200.0f, 800.0f);
 
   float prev_time = 0.0f;
   float curr_time;
   float dt;
 
+  // Runs without a GL context, for render nodes with no GPU.
+  if (argc > 1 && strcmp(argv[1], "--bench-cpu-render") == 0) {
+    benchmarkSoftwareRendering(screen_size, argc > 2 ? argv[2] : nullptr);
+    return 0;
+  }
+
   // GLFW: Init and config
   glfwInit();
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
@@ -31,6 +54,14 @@ int main() {
   glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
   // glfwWindowHint(GLFW_TRANSPARENT_FRAMEBUFFER, 1);
 
+  // --capture <file.y4m | directory> [frames]: render headless into an
+  // offscreen target and write every frame out.
+  const bool capturing = argc > 2 && strcmp(argv[1], "--capture") == 0;
+  const uint32_t capture_frames = argc > 3 ? atoi(argv[3]) : 600;
+  if (capturing) {
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+  }
+
   // GLFW: Create window
   GLFWwindow *window = glfwCreateWindow(screen_size.x, screen_size.y,
                                         "Particle Simulation", NULL, NULL);
@@ -52,15 +83,176 @@ int main() {
   // Gets called on window creation to init viewport
   glfwSetFramebufferSizeCallback(window, framebufferSizeCallback);
 
+  if (argc > 1 && strcmp(argv[1], "--bench-radix-sort") == 0) {
+    benchmarkRadixSort();
+    glfwTerminate();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-render") == 0) {
+    benchmarkRendering(screen_size);
+    glfwTerminate();
+    return 0;
+  }
+
   const float particle_radius = 4.f;
   const float particle_mass = 2.5f;
   const uint32_t particle_count = 50 * 50;
   const uint8_t sub_steps = 1;
   const float smoothing_radius = 16.f;
+  const bool cell_tiled_dispatch = false;
+  const bool neighbour_count_scheduling = false;
+  const bool gpu_stats = false;
+  const bool co_execution = false;
+  const bool surface_extraction = false;
+  const bool zero_copy_rendering = true;
+  const bool instanced_quads = true;
+  const bool fluid_surface = false;
+  const float surface_resolution_scale = 0.25f;
+  // Scroll zooms at the cursor, WASD pans, R resets the view.
+  const bool culling = true;
+  // Print how many instances survive culling each frame.
+  const bool culling_stats = false;
+  const bool threaded_simulation = false;
+  // Updates per second on the simulation thread, 0 runs flat out. The
+  // renderer interpolates between updates, so this can sit below the
+  // display rate.
+  const float sim_rate = 0.f;
+  // Save the solver every n updates (0 = off), restart with --restore.
+  const uint32_t checkpoint_interval = 0;
+  const std::string checkpoint_path = "checkpoint.bin";
+  // Save from a forked child so stepping carries on during the write, at
+  // the cost of the pages touched meanwhile being duplicated.
+  const bool fork_checkpoints = false;
+  const uint32_t max_checkpoint_children = 1;
+  // Stream particle states to this file for analysis ("" = off), every
+  // trajectory_cadence updates.
+  const std::string trajectory_path = "";
+  const uint32_t trajectory_cadence = 1;
+  const uint32_t trajectory_queue_frames = 8;
+  const TrajectoryBackpressure trajectory_backpressure = trajectory_decimate;
 
-  PhysicSolver physic_solver(screen_size, particle_count, particle_radius,
-                             particle_mass, sub_steps, smoothing_radius);
+  // --restore <checkpoint>: continue a saved run, with its parameters.
+  Checkpoint checkpoint;
+  const auto restore_start = std::chrono::steady_clock::now();
+  const bool restoring = argc > 2 && strcmp(argv[1], "--restore") == 0;
+  if (restoring && !checkpoint.open(argv[2])) {
+    glfwTerminate();
+    return -1;
+  }
+  const CheckpointHeader *saved = restoring ? checkpoint.header : nullptr;
+  PhysicSolver physic_solver(
+      saved ? glm::vec2(saved->world_size[0], saved->world_size[1])
+            : screen_size,
+      saved ? saved->particle_count : particle_count,
+      saved ? saved->particle_radius : particle_radius,
+      saved ? saved->particle_mass : particle_mass,
+      saved ? saved->sub_steps : sub_steps,
+      saved ? saved->smoothing_radius : smoothing_radius);
+  physic_solver.cell_tiled_dispatch = cell_tiled_dispatch;
+  physic_solver.neighbour_count_scheduling = neighbour_count_scheduling;
+  physic_solver.gpu_stats = gpu_stats;
+  physic_solver.co_execution = co_execution;
+  physic_solver.surface_extraction = surface_extraction;
+  if (restoring) {
+    if (!checkpoint.restore(physic_solver)) {
+      glfwTerminate();
+      return -1;
+    }
+    std::cout << "Restored " << physic_solver.particle_count
+              << " particles at update " << physic_solver.update_count
+              << " in "
+              << std::chrono::duration<float, std::milli>(
+                     std::chrono::steady_clock::now() - restore_start)
+                     .count()
+              << " ms\n";
+  }
+  // Saved from whichever thread runs the solver, between updates.
+  ForkedCheckpointer forked_checkpointer;
+  forked_checkpointer.max_children = max_checkpoint_children;
+  auto saveCheckpoint = [&]() {
+    const bool due = checkpoint_interval > 0 &&
+                     physic_solver.update_count % checkpoint_interval == 0;
+    if (fork_checkpoints) {
+      forked_checkpointer.reap();
+      if (due && !forked_checkpointer.save(physic_solver, checkpoint_path)) {
+        std::cout << "Checkpoint skipped, "
+                  << forked_checkpointer.children.size()
+                  << " still writing\n";
+      }
+    } else if (due) {
+      Checkpoint::save(physic_solver, checkpoint_path);
+    }
+  };
+  TrajectoryWriter *trajectory = nullptr;
+  if (!trajectory_path.empty()) {
+    trajectory = new TrajectoryWriter(
+        trajectory_path, physic_solver.particle_count, trajectory_queue_frames,
+        trajectory_cadence, trajectory_backpressure);
+  }
+  auto afterUpdate = [&]() {
+    if (trajectory != nullptr) {
+      trajectory->record(physic_solver);
+    }
+    saveCheckpoint();
+  };
+#ifdef USE_OPENCL
+  // e.g. device_type = CL_DEVICE_TYPE_CPU with numa_fission on a multi
+  // socket host.
+  physic_solver.opencl_options.device_name = "";
+  physic_solver.opencl_options.device_type = CL_DEVICE_TYPE_ALL;
+  physic_solver.opencl_options.numa_fission = false;
+  physic_solver.useOpenCl("./physics/fluid_sim_kernels.cl");
+#endif
   Renderer renderer(physic_solver);
+  renderer.zero_copy = zero_copy_rendering;
+  renderer.instanced_quads = instanced_quads;
+  renderer.fluid_surface = fluid_surface;
+  renderer.surface_resolution_scale = surface_resolution_scale;
+  renderer.culling = culling;
+  // Input callbacks steer the renderer's camera.
+  glfwSetWindowUserPointer(window, &renderer);
+  glfwSetScrollCallback(window, scrollCallback);
+  FrameCapture *capture = nullptr;
+  if (capturing) {
+    capture = new FrameCapture(screen_size.x, screen_size.y, argv[2]);
+  }
+  uint32_t frame_count = 0;
+
+  // Simulation on its own thread, through a hidden window whose context
+  // shares buffers and programs with the main one. The renderer draws the
+  // latest published snapshot, so neither side waits for the other.
+  GLFWwindow *sim_context = nullptr;
+  std::atomic<bool> sim_running(true);
+  std::thread sim_thread;
+  uint64_t last_update_count = 0;
+  if (threaded_simulation) {
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    sim_context = glfwCreateWindow(1, 1, "Simulation", NULL, window);
+    if (sim_context == NULL) {
+      std::cerr << "Failed to create GLFW simulation context\n";
+      glfwTerminate();
+      return -1;
+    }
+    physic_solver.publish_snapshots = true;
+    sim_thread = std::thread([&]() {
+      glfwMakeContextCurrent(sim_context);
+      double sim_prev_time = glfwGetTime();
+      auto next_tick = std::chrono::steady_clock::now();
+      while (sim_running) {
+        const double sim_curr_time = glfwGetTime();
+        physic_solver.update(sim_curr_time - sim_prev_time);
+        afterUpdate();
+        sim_prev_time = sim_curr_time;
+        if (sim_rate > 0.f) {
+          next_tick += std::chrono::duration_cast<
+              std::chrono::steady_clock::duration>(
+              std::chrono::duration<float>(1.f / sim_rate));
+          std::this_thread::sleep_until(next_tick);
+        }
+      }
+      glfwMakeContextCurrent(NULL);
+    });
+  }
 
   // Render loop
   while (!glfwWindowShouldClose(window)) {
@@ -74,11 +266,79 @@ int main() {
 
     processInput(window);
 
+    if (capture != nullptr) {
+      capture->begin();
+    }
     glClearColor(0.9f, 0.9f, 0.9f, 1.0f); // Set the clearing colour
     glClear(GL_COLOR_BUFFER_BIT);         // Use the clearing colour
 
-    physic_solver.update(dt);
+    if (!threaded_simulation) {
+      physic_solver.update(dt);
+      afterUpdate();
+      // Diagnostics read solver internals, only safe on the solver's thread.
+      if (physic_solver.cell_tiled_dispatch) {
+        // Compare global neighbour traffic against particle centric dispatch.
+        std::cout << "Neighbour reads (particle centric / cell tiled): "
+                  << physic_solver.estimateNeighbourReadBytes(false) / 1e6
+                  << " MB / "
+                  << physic_solver.estimateNeighbourReadBytes(true) / 1e6
+                  << " MB\n";
+      } else if (physic_solver.neighbour_count_scheduling) {
+        std::cout << "Idle lanes (unscheduled / scheduled): "
+                  << physic_solver.estimateIdleLanePercentage(false) << "% / "
+                  << physic_solver.estimateIdleLanePercentage(true) << "%\n";
+      }
+      if (physic_solver.co_execution) {
+        std::cout << "GPU share: "
+                  << physic_solver.co_execution_gpu_fraction * 100.f
+                  << "% (GPU " << physic_solver.co_execution_gpu_ms
+                  << " ms / CPU " << physic_solver.co_execution_cpu_ms
+                  << " ms)\n";
+      }
+      std::cout << "Bus per update: "
+                << physic_solver.update_uploaded_bytes / 1e3 << " KB up / "
+                << physic_solver.update_read_back_bytes / 1e3
+                << " KB read back\n";
+      if (physic_solver.surface_extraction) {
+        const SurfaceExtractor &extractor = *physic_solver.surface_extractor;
+        std::cout << "Surface: " << extractor.segment_total << " segments, "
+                  << extractor.dirty_block_total << " / "
+                  << extractor.dirty_blocks.size() << " blocks re-extracted\n";
+      }
+      if (physic_solver.gpu_stats) {
+        std::cout << "Max speed: " << physic_solver.stats.max_speed
+                  << " Mean density: " << physic_solver.stats.mean_density
+                  << " Kinetic energy: " << physic_solver.stats.kinetic_energy
+                  << "\n";
+      }
+    }
     renderer.drawParticles();
+    if (renderer.culling && culling_stats) {
+      std::cout << "Drawn instances: " << renderer.drawn_instances << " / "
+                << physic_solver.particle_count << "\n";
+    }
+    if (trajectory != nullptr) {
+      std::cout << "Trajectory queue: " << trajectory->queueDepth() << " / "
+                << trajectory->frames.size() << " frames, "
+                << trajectory->writeBandwidth() << " MB/s\n";
+    }
+    if (threaded_simulation) {
+      const uint64_t update_count =
+          physic_solver.snapshots.readBuffer().update_count;
+      std::cout << "Sim updates since last frame: "
+                << update_count - last_update_count << "\n";
+      last_update_count = update_count;
+    }
+
+    if (capture != nullptr) {
+      capture->end();
+      // Nothing is shown, so skip the swap and its vsync wait.
+      if (++frame_count >= capture_frames) {
+        glfwSetWindowShouldClose(window, true);
+      }
+      glfwPollEvents();
+      continue;
+    }
 
     glfwSwapBuffers(window); // Double buffering: swap current OpenGL colour
                              // buffer with the screen buffer to update screen
@@ -89,6 +349,13 @@ int main() {
   }
 
   // Clean up
+  if (threaded_simulation) {
+    sim_running = false;
+    sim_thread.join();
+    glfwDestroyWindow(sim_context);
+  }
+  delete capture;
+  delete trajectory;
   glfwTerminate();
   return 0;
 }
@@ -98,9 +365,178 @@ void framebufferSizeCallback(GLFWwindow *window, int width, int height) {
   glViewport(0, 0, width, height);
 }
 
+void scrollCallback(GLFWwindow *window, double x_offset, double y_offset) {
+  Renderer *renderer = (Renderer *)glfwGetWindowUserPointer(window);
+  double cursor_x, cursor_y;
+  int width, height;
+  glfwGetCursorPos(window, &cursor_x, &cursor_y);
+  glfwGetWindowSize(window, &width, &height);
+  // Window coordinates start top left, the viewport bottom left.
+  const glm::vec2 uv(cursor_x / width, 1.0 - cursor_y / height);
+  renderer->camera.zoomAt(std::pow(1.1f, (float)y_offset), uv);
+}
+
 // Input handling function
 void processInput(GLFWwindow *window) {
   if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
     glfwSetWindowShouldClose(window, true);
   }
+
+  Renderer *renderer = (Renderer *)glfwGetWindowUserPointer(window);
+  if (renderer == nullptr)
+    return;
+  // Per frame, a fraction of the view so panning feels the same at any zoom.
+  const glm::vec2 step = renderer->camera.halfExtent() * 0.02f;
+  glm::vec2 pan(0.f);
+  if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
+    pan.y += step.y;
+  if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
+    pan.y -= step.y;
+  if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
+    pan.x -= step.x;
+  if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
+    pan.x += step.x;
+  renderer->camera.pan(pan);
+  if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS) {
+    renderer->camera.reset();
+  }
+}
+
+// Time sort + gather of one vec2 attribute for increasing key counts.
+void benchmarkRadixSort() {
+  RadixSort radix_sort;
+  const uint32_t counts[] = {100000, 1000000, 10000000};
+  const uint32_t key_bits = 24;
+  const uint32_t repeats = 5;
+
+  std::mt19937 rng(42);
+  for (const uint32_t count : counts) {
+    std::vector<uint32_t> keys(count);
+    for (uint32_t &key : keys) {
+      key = rng() & ((1u << key_bits) - 1);
+    }
+
+    // Keys, a vec2 payload to time gathers with, and a second copy of the
+    // keys to check the gather against.
+    uint32_t buffers[3];
+    glGenBuffers(3, buffers);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[0]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t) * count,
+                 keys.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[1]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(glm::vec2) * count, NULL,
+                 GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[2]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t) * count,
+                 keys.data(), GL_DYNAMIC_COPY);
+    while (glGetError() != GL_NO_ERROR) {
+    }
+
+    // Warm up, also checks the result once: the sorted keys must match a
+    // host sort, and gathering the keys by the permutation must too.
+    radix_sort.sort(buffers[0], count, key_bits);
+    radix_sort.gatherInPlace(buffers[2], count, sizeof(uint32_t));
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    std::vector<uint32_t> sorted(count);
+    std::vector<uint32_t> gathered(count);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, radix_sort.sortedKeys());
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(uint32_t) * count,
+                       sorted.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[2]);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(uint32_t) * count,
+                       gathered.data());
+    std::vector<uint32_t> expected = keys;
+    std::sort(expected.begin(), expected.end());
+    const bool is_sorted = sorted == expected && gathered == expected;
+
+    glFinish();
+    const double start = glfwGetTime();
+    for (uint32_t i = 0; i < repeats; i++) {
+      radix_sort.sort(buffers[0], count, key_bits);
+      radix_sort.gatherInPlace(buffers[1], count, sizeof(glm::vec2));
+    }
+    glFinish();
+    const double ms = (glfwGetTime() - start) * 1000.0 / repeats;
+    // A failed dispatch would otherwise be timed as a very fast sort.
+    const GLenum gl_error = glGetError();
+
+    std::cout << "Radix sort " << count << " keys: " << ms << " ms, "
+              << count / (ms * 1000.0) << " Mkeys/s"
+              << (is_sorted ? "" : " (NOT SORTED)");
+    if (gl_error != GL_NO_ERROR) {
+      std::cout << " (GL error 0x" << std::hex << gl_error << std::dec << ")";
+    }
+    std::cout << "\n";
+
+    glDeleteBuffers(3, buffers);
+  }
+}
+
+// GPU time of one particle draw, points against instanced quads.
+void benchmarkRendering(const glm::vec2 screen_size) {
+  // Particle counts must be square for the spawn grid, ~10k to ~5M.
+  const uint32_t sides[] = {100, 317, 1000, 2237};
+  const uint32_t frames = 20;
+
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> x_dist(0.f, screen_size.x);
+  std::uniform_real_distribution<float> y_dist(0.f, screen_size.y);
+  for (const uint32_t side : sides) {
+    const uint32_t count = side * side;
+    PhysicSolver solver(screen_size, count, 4.f, 2.5f, 1, 16.f);
+    // The spawn grid would put most particles off screen.
+    for (glm::vec2 &pos : solver.particles.positions) {
+      pos = glm::vec2(x_dist(rng), y_dist(rng));
+    }
+    Renderer renderer(solver);
+
+    renderer.instanced_quads = false;
+    const float points_ms = renderer.benchmarkDraw(frames);
+    renderer.instanced_quads = true;
+    const float quads_ms = renderer.benchmarkDraw(frames);
+
+    std::cout << "Render " << count << " particles: points " << points_ms
+              << " ms, instanced quads " << quads_ms << " ms\n";
+  }
+}
+
+void benchmarkSoftwareRendering(const glm::vec2 screen_size,
+                                const char *output_path) {
+  // Same counts and layout as benchmarkRendering, for comparison.
+  const uint32_t sides[] = {100, 317, 1000, 2237};
+  const uint32_t frames = 5;
+
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> x_dist(0.f, screen_size.x);
+  std::uniform_real_distribution<float> y_dist(0.f, screen_size.y);
+  SoftwareRenderer renderer(screen_size.x, screen_size.y);
+  const Camera camera(screen_size);
+  for (const uint32_t side : sides) {
+    const uint32_t count = side * side;
+    Particles particles(count);
+    for (glm::vec2 &pos : particles.positions) {
+      pos = glm::vec2(x_dist(rng), y_dist(rng));
+    }
+
+    float ms[2];
+    for (const bool surface : {false, true}) {
+      renderer.fluid_surface = surface;
+      const auto start = std::chrono::steady_clock::now();
+      for (uint32_t i = 0; i < frames; i++) {
+        renderer.render(particles, 4.f, 16.f, camera);
+      }
+      ms[surface] = std::chrono::duration<float, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count() /
+                    frames;
+    }
+
+    std::cout << "CPU render " << count << " particles: circles " << ms[0]
+              << " ms, fluid surface " << ms[1] << " ms ("
+              << renderer.thread_count << " threads)\n";
+  }
+
+  if (output_path != nullptr) {
+    renderer.writePpm(output_path);
+  }
 }
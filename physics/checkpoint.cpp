@@ -0,0 +1,391 @@
+#include "checkpoint.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+const char checkpoint_magic[8] = {'S', 'P', 'H', 'C', 'K', 'P', 'T', '\0'};
+const uint32_t checkpoint_byte_order = 0x01020304;
+
+uint64_t alignUp(const uint64_t value) {
+  return (value + Checkpoint::alignment - 1) & ~(Checkpoint::alignment - 1);
+}
+
+struct SectionSource {
+  uint32_t id;
+  uint32_t element_bytes;
+  const void *data;
+  uint64_t count;
+};
+
+template <typename T>
+SectionSource sectionOf(const uint32_t id, const std::vector<T> &vec) {
+  return {id, sizeof(T), vec.data(), vec.size()};
+}
+
+template <typename T>
+bool copySection(const Checkpoint &checkpoint, const uint32_t id,
+                  std::vector<T> &vec) {
+  uint64_t count = 0;
+  const void *data = checkpoint.section(id, sizeof(T), count);
+  if (data == nullptr || count != vec.size()) {
+    std::cerr << "Checkpoint section " << id << " is missing or mismatched\n";
+    return false;
+  }
+  std::memcpy(vec.data(), data, sizeof(T) * count);
+  return true;
+}
+
+// Anonymous memory only this process holds. In a forked child that grows
+// as the parent writes to pages they shared, since the parent then gets
+// the copy and the child keeps the original.
+uint64_t privateDirtyBytes() {
+  std::ifstream smaps("/proc/self/smaps_rollup");
+  std::string field;
+  uint64_t kilobytes = 0;
+  while (smaps >> field) {
+    if (field == "Private_Dirty:") {
+      smaps >> kilobytes;
+      return kilobytes * 1024;
+    }
+  }
+  return 0;
+}
+
+// What a snapshot child sends back before it exits.
+struct ForkReport {
+  uint64_t cow_bytes;
+  uint8_t ok;
+};
+
+} // namespace
+
+Checkpoint::~Checkpoint() {
+  if (this->data != nullptr) {
+    munmap((void *)this->data, this->size);
+  }
+}
+
+bool Checkpoint::save(PhysicSolver &solver, const std::string &path) {
+  const std::vector<SectionSource> sources = {
+      sectionOf(checkpoint_positions, solver.particles.positions),
+      sectionOf(checkpoint_velocities, solver.particles.velocities),
+      sectionOf(checkpoint_forces, solver.particles.forces),
+      sectionOf(checkpoint_densities, solver.particles.densities),
+      sectionOf(checkpoint_species, solver.particles.species),
+      sectionOf(checkpoint_ids, solver.particles.ids),
+  };
+
+  CheckpointHeader header = {};
+  std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+  header.version = version;
+  header.byte_order = checkpoint_byte_order;
+  header.section_count = sources.size();
+  header.particle_count = solver.particle_count;
+  header.world_size[0] = solver.world_size.x;
+  header.world_size[1] = solver.world_size.y;
+  header.particle_radius = solver.particle_radius;
+  header.particle_mass = solver.particle_mass;
+  header.smoothing_radius = solver.smoothing_radius;
+  header.sub_steps = solver.sub_steps;
+  header.cell_width = solver.spatial_grid->cell_width;
+  header.bucket_count = solver.spatial_grid->spatial_lookup.size() - 1;
+  header.cell_tiled_dispatch = solver.cell_tiled_dispatch;
+  header.fused_gpu_step = solver.fused_gpu_step;
+  header.neighbour_count_scheduling = solver.neighbour_count_scheduling;
+  header.gpu_sort_interval = solver.gpu_sort_interval;
+  header.update_count = solver.update_count;
+  header.reorder_count = solver.reorder_count;
+  header.run_id = solver.run_id;
+
+  std::vector<CheckpointSection> sections(sources.size());
+  uint64_t offset = alignUp(sizeof(CheckpointHeader) +
+                            sizeof(CheckpointSection) * sections.size());
+  for (size_t i = 0; i < sources.size(); i++) {
+    sections[i] = {sources[i].id, sources[i].element_bytes, offset,
+                   sources[i].element_bytes * sources[i].count};
+    offset = alignUp(offset + sections[i].bytes);
+  }
+
+  // Unique per process, forked savers may be writing at the same time.
+  const std::string temp_path = path + ".tmp." + std::to_string(getpid());
+  FILE *file = fopen(temp_path.c_str(), "wb");
+  if (file == nullptr) {
+    std::cerr << "Failed to write checkpoint: " << temp_path << "\n";
+    return false;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && fwrite(sections.data(), sizeof(CheckpointSection),
+                    sections.size(), file) == sections.size();
+  for (size_t i = 0; ok && i < sources.size(); i++) {
+    ok = fseek(file, sections[i].offset, SEEK_SET) == 0 &&
+         fwrite(sources[i].data, 1, sections[i].bytes, file) ==
+             sections[i].bytes;
+  }
+  // Pad the last section so the file ends on a page boundary too, without
+  // touching its data when it already does.
+  ok = ok && fflush(file) == 0 && ftruncate(fileno(file), offset) == 0;
+  ok = ok && fsync(fileno(file)) == 0;
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    std::cerr << "Failed to write checkpoint: " << path << "\n";
+    remove(temp_path.c_str());
+    return false;
+  }
+
+  // A slower save of an older update must not rename over a newer one, so
+  // the compare and rename happen under a lock shared by all savers.
+  const int lock_fd = ::open((path + ".lock").c_str(), O_CREAT | O_RDWR, 0644);
+  if (lock_fd >= 0) {
+    flock(lock_fd, LOCK_EX);
+  }
+  CheckpointHeader saved = {};
+  const bool stale = savedHeader(path, saved) &&
+                     saved.run_id == header.run_id &&
+                     saved.update_count > header.update_count;
+  if (stale) {
+    ok = false;
+    std::cerr << "Checkpoint of update " << header.update_count
+              << " not saved, " << path << " already holds update "
+              << saved.update_count << "\n";
+    remove(temp_path.c_str());
+  } else if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    ok = false;
+    std::cerr << "Failed to write checkpoint: " << path << "\n";
+    remove(temp_path.c_str());
+  }
+  if (lock_fd >= 0) {
+    close(lock_fd);
+  }
+  return ok;
+}
+
+bool Checkpoint::savedHeader(const std::string &path,
+                             CheckpointHeader &header) {
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  const bool read_ok =
+      pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+  close(fd);
+  return read_ok &&
+         std::memcmp(header.magic, checkpoint_magic,
+                     sizeof(checkpoint_magic)) == 0 &&
+         header.byte_order == checkpoint_byte_order &&
+         header.version == version;
+}
+
+bool Checkpoint::open(const std::string &path, const bool lazy) {
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Failed to open checkpoint: " << path << "\n";
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 ||
+      file_stat.st_size < (off_t)sizeof(CheckpointHeader)) {
+    std::cerr << "Checkpoint too small: " << path << "\n";
+    close(fd);
+    return false;
+  }
+
+  this->size = file_stat.st_size;
+  const int flags = lazy ? MAP_PRIVATE : MAP_PRIVATE | MAP_POPULATE;
+  void *mapping = mmap(nullptr, this->size, PROT_READ, flags, fd, 0);
+  // The mapping keeps its own reference to the file.
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    std::cerr << "Failed to map checkpoint: " << path << "\n";
+    return false;
+  }
+  madvise(mapping, this->size, lazy ? MADV_RANDOM : MADV_SEQUENTIAL);
+  this->data = (const uint8_t *)mapping;
+  this->header = (const CheckpointHeader *)this->data;
+
+  if (std::memcmp(this->header->magic, checkpoint_magic,
+                  sizeof(checkpoint_magic)) != 0 ||
+      this->header->byte_order != checkpoint_byte_order) {
+    std::cerr << "Not a checkpoint for this machine: " << path << "\n";
+    return false;
+  }
+  if (this->header->version != version) {
+    std::cerr << "Unsupported checkpoint version " << this->header->version
+              << ": " << path << "\n";
+    return false;
+  }
+  const uint64_t table_end = sizeof(CheckpointHeader) +
+                             sizeof(CheckpointSection) *
+                                 (uint64_t)this->header->section_count;
+  if (table_end > this->size) {
+    std::cerr << "Truncated checkpoint: " << path << "\n";
+    return false;
+  }
+  this->sections =
+      (const CheckpointSection *)(this->data + sizeof(CheckpointHeader));
+  for (uint32_t i = 0; i < this->header->section_count; i++) {
+    if (this->sections[i].offset + this->sections[i].bytes > this->size) {
+      std::cerr << "Truncated checkpoint: " << path << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+const void *Checkpoint::section(const uint32_t id,
+                                const uint32_t element_bytes,
+                                uint64_t &count) const {
+  for (uint32_t i = 0; i < this->header->section_count; i++) {
+    const CheckpointSection &section = this->sections[i];
+    if (section.id == id && section.element_bytes == element_bytes) {
+      count = section.bytes / element_bytes;
+      return this->data + section.offset;
+    }
+  }
+  count = 0;
+  return nullptr;
+}
+
+bool Checkpoint::restore(PhysicSolver &solver) const {
+  if (this->header->particle_count != solver.particle_count ||
+      this->header->bucket_count !=
+          solver.spatial_grid->spatial_lookup.size() - 1) {
+    std::cerr << "Checkpoint holds " << this->header->particle_count
+              << " particles in " << this->header->bucket_count
+              << " buckets, solver doesn't match\n";
+    return false;
+  }
+
+  bool ok = copySection(*this, checkpoint_positions, solver.particles.positions);
+  ok = ok && copySection(*this, checkpoint_velocities,
+                         solver.particles.velocities);
+  ok = ok && copySection(*this, checkpoint_forces, solver.particles.forces);
+  ok = ok &&
+       copySection(*this, checkpoint_densities, solver.particles.densities);
+  ok = ok && copySection(*this, checkpoint_species, solver.particles.species);
+  if (!ok)
+    return false;
+  // Not every update path keeps the host cell keys current, so they are
+  // derived from the restored positions rather than stored.
+  solver.spatial_grid->updateCellKeys();
+  // Checkpoints without ids keep the solver's spawn order ids.
+  uint64_t id_count = 0;
+  if (this->section(checkpoint_ids, sizeof(uint32_t), id_count) != nullptr &&
+      !copySection(*this, checkpoint_ids, solver.particles.ids)) {
+    return false;
+  }
+
+  solver.cell_tiled_dispatch = this->header->cell_tiled_dispatch;
+  solver.fused_gpu_step = this->header->fused_gpu_step;
+  solver.neighbour_count_scheduling = this->header->neighbour_count_scheduling;
+  solver.gpu_sort_interval = this->header->gpu_sort_interval;
+  solver.update_count = this->header->update_count;
+  solver.reorder_count = this->header->reorder_count;
+  solver.run_id = this->header->run_id;
+
+  // Everything on the GPU predates the restore.
+  solver.positions_dirty.markAll();
+  solver.velocities_dirty.markAll();
+  solver.uploaded_lookup.clear();
+  solver.uploaded_indicies.clear();
+  solver.uploaded_dispatch_order.clear();
+  solver.state_in_next_buffers = false;
+  solver.gpu_positions_ssbo = 0;
+  solver.species_changed = true;
+  return true;
+}
+
+ForkedCheckpointer::~ForkedCheckpointer() { this->reap(true); }
+
+bool ForkedCheckpointer::save(PhysicSolver &solver, const std::string &path) {
+  this->reap();
+  if (this->children.size() >= this->max_children) {
+    this->skipped++;
+    return false;
+  }
+
+  int report_pipe[2];
+  if (pipe(report_pipe) != 0) {
+    std::cerr << "Failed to fork checkpoint: " << strerror(errno) << "\n";
+    this->failed++;
+    return false;
+  }
+  // Anything buffered would otherwise be flushed by both processes.
+  std::cout.flush();
+  fflush(nullptr);
+
+  const pid_t pid = fork();
+  if (pid < 0) {
+    std::cerr << "Failed to fork checkpoint: " << strerror(errno) << "\n";
+    close(report_pipe[0]);
+    close(report_pipe[1]);
+    this->failed++;
+    return false;
+  }
+
+  if (pid == 0) {
+    // Only this thread exists here and the GL context is unusable, so the
+    // child sticks to the host arrays and skips every exit handler.
+    close(report_pipe[0]);
+    const uint64_t private_at_fork = privateDirtyBytes();
+    ForkReport report = {};
+    report.ok = Checkpoint::save(solver, path);
+    const uint64_t private_at_end = privateDirtyBytes();
+    report.cow_bytes =
+        private_at_end > private_at_fork ? private_at_end - private_at_fork : 0;
+    const bool sent =
+        write(report_pipe[1], &report, sizeof(report)) == sizeof(report);
+    _exit(report.ok && sent ? 0 : 1);
+  }
+
+  close(report_pipe[1]);
+  this->children.push_back(
+      {pid, report_pipe[0], std::chrono::steady_clock::now()});
+  this->started++;
+  return true;
+}
+
+void ForkedCheckpointer::reap(const bool blocking) {
+  for (size_t i = 0; i < this->children.size();) {
+    Child &child = this->children[i];
+    int status = 0;
+    const pid_t result = waitpid(child.pid, &status, blocking ? 0 : WNOHANG);
+    if (result == 0 || (result < 0 && errno == EINTR)) {
+      i++;
+      continue;
+    }
+
+    ForkReport report = {};
+    const bool reported =
+        read(child.report_fd, &report, sizeof(report)) == sizeof(report);
+    close(child.report_fd);
+    const float seconds = std::chrono::duration<float>(
+                              std::chrono::steady_clock::now() - child.start)
+                              .count();
+    if (result > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+        reported && report.ok) {
+      this->last_cow_bytes = report.cow_bytes;
+      this->max_cow_bytes = std::max(this->max_cow_bytes, report.cow_bytes);
+      std::cout << "Forked checkpoint written in " << seconds
+                << "s, copy on write added "
+                << report.cow_bytes / (1024.f * 1024.f) << " MB\n";
+    } else {
+      this->failed++;
+      std::cerr << "Forked checkpoint failed after " << seconds << "s\n";
+    }
+    this->children.erase(this->children.begin() + i);
+  }
+}
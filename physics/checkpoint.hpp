@@ -0,0 +1,131 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "physics.hpp"
+
+// On disk layout of a checkpoint, native endian (checked through
+// byte_order): the header, a table of sections, then each section's array
+// starting on a page boundary. Readers look sections up by id and skip ids
+// they don't know, so sections can be added without a version bump.
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t section_count;
+  uint32_t particle_count;
+  // Solver parameters
+  float world_size[2];
+  float particle_radius;
+  float particle_mass;
+  float smoothing_radius;
+  uint32_t sub_steps;
+  // Grid settings
+  float cell_width;
+  uint32_t bucket_count;
+  // Dispatch options
+  uint32_t cell_tiled_dispatch;
+  uint32_t fused_gpu_step;
+  uint32_t neighbour_count_scheduling;
+  uint32_t gpu_sort_interval;
+  uint64_t update_count;
+  uint64_t reorder_count;
+  uint64_t run_id;
+};
+
+enum CheckpointSectionId : uint32_t {
+  checkpoint_positions = 1,
+  checkpoint_velocities = 2,
+  checkpoint_forces = 3,
+  checkpoint_densities = 4,
+  checkpoint_species = 5,
+  // No longer written, older files' copies are ignored.
+  checkpoint_cell_keys = 6,
+  checkpoint_ids = 7,
+};
+
+struct CheckpointSection {
+  uint32_t id;
+  uint32_t element_bytes;
+  uint64_t offset;
+  uint64_t bytes;
+};
+
+// A checkpoint mapped read only. Loading is the mmap plus a header check,
+// arrays are then read in place or copied straight into a solver.
+struct Checkpoint {
+  static const uint32_t version = 2;
+  static const uint64_t alignment = 4096;
+
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  const CheckpointHeader *header = nullptr;
+  const CheckpointSection *sections = nullptr;
+
+  Checkpoint() = default;
+  Checkpoint(const Checkpoint &) = delete;
+  Checkpoint &operator=(const Checkpoint &) = delete;
+  ~Checkpoint();
+
+  // Written to a temporary file and renamed over path, so a crash while
+  // saving leaves the previous checkpoint intact. A checkpoint already at
+  // path from a later update of the same run is never replaced.
+  static bool save(PhysicSolver &solver, const std::string &path);
+
+  // Header of the checkpoint at path, false if there is none.
+  static bool savedHeader(const std::string &path, CheckpointHeader &header);
+
+  // Lazy leaves pages to fault in on first access, for tools that only
+  // read part of a checkpoint. Otherwise the whole file is read ahead.
+  bool open(const std::string &path, const bool lazy = false);
+
+  // Start of a section's array, nullptr when absent or the wrong type.
+  const void *section(const uint32_t id, const uint32_t element_bytes,
+                      uint64_t &count) const;
+
+  // Copy the arrays and options into a solver built with the same
+  // particle count.
+  bool restore(PhysicSolver &solver) const;
+};
+
+// Saves checkpoints from a fork()ed child, which serialises its copy on
+// write image of the solver while the parent keeps stepping. Pages the
+// parent writes meanwhile are duplicated, the child reports how much that
+// came to from its own private memory.
+//
+// Only call between updates, from the thread that runs the solver. The
+// child never touches GL and leaves through _exit.
+struct ForkedCheckpointer {
+  struct Child {
+    pid_t pid;
+    int report_fd;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  // Further saves are skipped while this many children are running.
+  uint32_t max_children = 1;
+  std::vector<Child> children;
+
+  uint32_t started = 0;
+  uint32_t skipped = 0;
+  uint32_t failed = 0;
+  uint64_t last_cow_bytes = 0;
+  uint64_t max_cow_bytes = 0;
+
+  ForkedCheckpointer() = default;
+  ForkedCheckpointer(const ForkedCheckpointer &) = delete;
+  ForkedCheckpointer &operator=(const ForkedCheckpointer &) = delete;
+  // Waits for every child, their checkpoints are still wanted.
+  ~ForkedCheckpointer();
+
+  // False when skipped because of max_children, or fork failed.
+  bool save(PhysicSolver &solver, const std::string &path);
+
+  // Collect finished children, waiting for all of them when blocking.
+  void reap(const bool blocking = false);
+};
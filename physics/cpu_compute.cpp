@@ -0,0 +1,190 @@
+#include "cpu_compute.hpp"
+
+#include <algorithm>
+#include <thread>
+
+#include <glm/geometric.hpp>
+
+const float pi = 3.14159265f;
+
+CpuCompute::CpuCompute(Particles &_particles, SpatialGrid *_spatial_grid,
+                       const float _h, const float _particle_mass,
+                       const float _target_density,
+                       const float _pressure_multiplier,
+                       const float _near_pressure_multiplier,
+                       const float _viscosity_strength)
+    : particles(_particles), spatial_grid(_spatial_grid), h(_h),
+      particle_mass(_particle_mass), target_density(_target_density),
+      pressure_multiplier(_pressure_multiplier),
+      near_pressure_multiplier(_near_pressure_multiplier),
+      viscosity_strength(_viscosity_strength) {
+  // Leave one core for the thread driving GL. hardware_concurrency() may
+  // be 0 when unknown.
+  this->thread_count =
+      std::max(1u, std::max(1u, std::thread::hardware_concurrency()) - 1);
+  for (uint32_t t = 0; t < this->thread_count; t++) {
+    this->workers.emplace_back(&CpuCompute::workerLoop, this, t);
+  }
+}
+
+CpuCompute::~CpuCompute() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+  }
+  this->work_ready.notify_all();
+  for (std::thread &worker : this->workers) {
+    worker.join();
+  }
+}
+
+template <typename F>
+void CpuCompute::parallelFor(const uint32_t count, F func) {
+  // One indirect call per worker, the loop over its range stays inlined.
+  const std::function<void(uint32_t, uint32_t)> range_func =
+      [&func](uint32_t start, uint32_t end) {
+        for (uint32_t i = start; i < end; i++) {
+          func(i);
+        }
+      };
+  this->runOnWorkers(count, range_func);
+}
+
+void CpuCompute::runOnWorkers(
+    const uint32_t count,
+    const std::function<void(uint32_t, uint32_t)> &func) {
+  if (count == 0) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->job = &func;
+  this->job_count = count;
+  this->workers_pending = this->thread_count;
+  this->job_generation++;
+  this->work_ready.notify_all();
+  this->work_done.wait(lock, [this]() { return this->workers_pending == 0; });
+  this->job = nullptr;
+}
+
+void CpuCompute::workerLoop(const uint32_t worker) {
+  uint64_t seen_generation = 0;
+  while (true) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->work_ready.wait(lock, [&]() {
+      return this->stopping || this->job_generation != seen_generation;
+    });
+    if (this->stopping) {
+      return;
+    }
+    seen_generation = this->job_generation;
+    const std::function<void(uint32_t, uint32_t)> &func = *this->job;
+    const uint32_t count = this->job_count;
+    lock.unlock();
+
+    const uint32_t chunk =
+        (count + this->thread_count - 1) / this->thread_count;
+    const uint32_t start = std::min(worker * chunk, count);
+    const uint32_t end = std::min(start + chunk, count);
+    func(start, end);
+
+    lock.lock();
+    if (--this->workers_pending == 0) {
+      this->work_done.notify_one();
+    }
+  }
+}
+
+void CpuCompute::calcDensities(const std::vector<int32_t> &order,
+                               const uint32_t count) {
+  this->parallelFor(count, [&](uint32_t i) { this->calcDensity(order[i]); });
+}
+
+void CpuCompute::applyFluidForces(const std::vector<int32_t> &order,
+                                  const uint32_t count) {
+  this->parallelFor(count, [&](uint32_t i) {
+    this->particles.forces[order[i]] = this->calcFluidForce(order[i]);
+  });
+}
+
+void CpuCompute::calcDensity(const int32_t p_i) {
+  const std::vector<int32_t> &lookup = this->spatial_grid->spatial_lookup;
+  const std::vector<int32_t> &indicies = this->spatial_grid->spatial_indicies;
+  const glm::vec2 pos = this->particles.positions[p_i];
+  const glm::ivec2 cell_coord = this->spatial_grid->positionToCellCoord(pos);
+  const float poly6 = 4.f / (pi * glm::pow(this->h, 8.f));
+
+  float density = 0.f;
+  for (int32_t y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
+    for (int32_t x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
+      const int32_t hash = this->spatial_grid->cellCoordToHash({x, y});
+      for (int32_t i = lookup[hash]; i < lookup[hash + 1]; i++) {
+        const float r =
+            glm::distance(pos, this->particles.positions[indicies[i]]);
+        if (r < this->h) {
+          density += this->particle_mass * poly6 *
+                     glm::pow(this->h * this->h - r * r, 3.f);
+        }
+      }
+    }
+  }
+
+  this->particles.densities[p_i] = glm::vec2(density, 0.f);
+}
+
+glm::vec2 CpuCompute::densityToPressure(const float density,
+                                        const float near_density) {
+  return glm::vec2((density - this->target_density) * this->pressure_multiplier,
+                   near_density * this->near_pressure_multiplier);
+}
+
+glm::vec2 CpuCompute::calcFluidForce(const int32_t p_i) {
+  const std::vector<int32_t> &lookup = this->spatial_grid->spatial_lookup;
+  const std::vector<int32_t> &indicies = this->spatial_grid->spatial_indicies;
+  const std::vector<glm::vec2> &positions = this->particles.positions;
+  const std::vector<glm::vec2> &velocities = this->particles.velocities;
+  const std::vector<glm::vec2> &densities = this->particles.densities;
+
+  const glm::vec2 pos = positions[p_i];
+  const glm::ivec2 cell_coord = this->spatial_grid->positionToCellCoord(pos);
+  const float spiky_grad = -10.f / (glm::pow(this->h, 5.f) * pi);
+  const float laplacian = 40.f / (glm::pow(this->h, 5.f) * pi);
+
+  const float curr_density = densities[p_i].x;
+  const float curr_pressure =
+      this->densityToPressure(curr_density, densities[p_i].y).x;
+
+  glm::vec2 pressure_force(0.f);
+  glm::vec2 visc_force(0.f);
+  for (int32_t y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
+    for (int32_t x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
+      const int32_t hash = this->spatial_grid->cellCoordToHash({x, y});
+      for (int32_t i = lookup[hash]; i < lookup[hash + 1]; i++) {
+        const int32_t n_i = indicies[i];
+        // Skip self
+        if (n_i == p_i)
+          continue;
+
+        const float r = glm::distance(pos, positions[n_i]);
+        if (r < this->h) {
+          const float neighbour_density = densities[n_i].x;
+          const float neighbour_pressure =
+              this->densityToPressure(neighbour_density, densities[n_i].y).x;
+          const float shared_pressure = 0.5f * (curr_pressure + neighbour_pressure);
+          const glm::vec2 rij = glm::normalize(positions[n_i] - pos);
+
+          pressure_force += -rij * this->particle_mass * spiky_grad *
+                            glm::pow(this->h - r, 3.f) * shared_pressure /
+                            neighbour_density;
+          visc_force += this->particle_mass * laplacian * (this->h - r) *
+                        (velocities[n_i] - velocities[p_i]) / neighbour_density;
+        }
+      }
+    }
+  }
+
+  visc_force *= this->viscosity_strength;
+
+  const glm::vec2 grav_force =
+      glm::vec2(0.f, -9.81f) * this->particle_mass / curr_density;
+  return pressure_force + visc_force + grav_force;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "particles.hpp"
+#include "spatial_grid.hpp"
+
+// Threaded host implementation of the density and force kernels in
+// fluid_sim.cs.glsl, so part of the domain can run on otherwise idle cores.
+// Workers are started once and wait between passes, so a pass costs a wake
+// up rather than a thread spawn per worker.
+struct CpuCompute {
+  Particles &particles;
+  SpatialGrid *spatial_grid;
+  uint32_t thread_count;
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable work_ready;
+  std::condition_variable work_done;
+  // The current pass, each worker runs its share of [0, job_count).
+  const std::function<void(uint32_t, uint32_t)> *job = nullptr;
+  uint32_t job_count = 0;
+  uint64_t job_generation = 0;
+  uint32_t workers_pending = 0;
+  bool stopping = false;
+
+  float h;
+  float particle_mass;
+  float target_density;
+  float pressure_multiplier;
+  float near_pressure_multiplier;
+  float viscosity_strength;
+
+  CpuCompute(Particles &_particles, SpatialGrid *_spatial_grid,
+             const float _h, const float _particle_mass,
+             const float _target_density, const float _pressure_multiplier,
+             const float _near_pressure_multiplier,
+             const float _viscosity_strength);
+  CpuCompute(const CpuCompute &) = delete;
+  CpuCompute &operator=(const CpuCompute &) = delete;
+  ~CpuCompute();
+
+  // Both passes work on particles order[0..count), split across threads.
+  void calcDensities(const std::vector<int32_t> &order, const uint32_t count);
+
+  void applyFluidForces(const std::vector<int32_t> &order,
+                        const uint32_t count);
+
+  void calcDensity(const int32_t p_i);
+
+  glm::vec2 calcFluidForce(const int32_t p_i);
+
+  glm::vec2 densityToPressure(const float density, const float near_density);
+
+  template <typename F>
+  void parallelFor(const uint32_t count, F func);
+
+  // Hand func to every worker and wait until all of them are done.
+  void runOnWorkers(const uint32_t count,
+                    const std::function<void(uint32_t, uint32_t)> &func);
+
+  void workerLoop(const uint32_t worker);
+};
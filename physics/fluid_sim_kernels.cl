@@ -1,127 +1,207 @@
+// OpenCL port of renderer/shaders/fluid_sim.cs.glsl. Runs on any OpenCL
+// device, including POCL on the CPU.
+
 __constant float pi = 3.14159265f;
 
-__constant float h = 50.0f; // Smoothing radius
-__constant float h2 = h * h;
-__constant float h3 = h2 * h;
-__constant float h5 = h3 * h2;
+// Scene constants come in as -D build options from PhysicSolver::useOpenCl,
+// so the compiler can fold them into the kernels.
+#if !defined(SMOOTHING_RADIUS) || !defined(PARTICLE_MASS) || \
+    !defined(TARGET_DENSITY) || !defined(PRESSURE_MULTIPLIER) || \
+    !defined(NEAR_PRESSURE_MULTIPLIER) || !defined(VISCOSITY_STRENGTH) || \
+    !defined(BOUNDARY_DAMPING)
+#error "Scene constants must be passed as build options"
+#endif
+
+__constant float h = SMOOTHING_RADIUS;
+__constant float particle_mass = PARTICLE_MASS;
+__constant float target_density = TARGET_DENSITY;
+__constant float pressure_multiplier = PRESSURE_MULTIPLIER;
+__constant float near_pressure_multiplier = NEAR_PRESSURE_MULTIPLIER;
+__constant float viscosity_strength = VISCOSITY_STRENGTH;
+__constant float boundary_damping = BOUNDARY_DAMPING;
+
+float poly6Kernel(float r) {
+    return 4.0f / (pi * pown(h, 8)) * pown(h * h - r * r, 3);
+}
 
-__constant unsigned int particle_count = 1000;
-__constant unsigned int spatial_bucket_count = particle_count+1;
+float spikyGradKernel(float r) {
+    return -10.0f / (pown(h, 5) * pi) * pown(h - r, 3);
+}
 
-__constant float target_density = 10.0f;
-__constant float pressure_multiplier = 10.0f;
+float laplacianKernel(float r) {
+    return 40.0f / (pown(h, 5) * pi) * (h - r);
+}
 
-int smoothingWeight(float r) {
-    float x = 1.0f - r * r / h2;
-    return 315.0f / (64.0f * pi * h3) * x * x * x;
+int2 positionToCellCoord(float2 pos) {
+    const float cell_width = 2.0f * h;
+    return convert_int2_rtz(pos / cell_width);
 }
 
-int smoothingWeightDerivative(float r) {
-    float x = 1.0f - r * r / h2;
-    return -945.0f / (32.0f * pi * h3 * h5) * r * x * x;
+int cellCoordToHash(int2 cell_coord, uint bucket_count) {
+    int prime1 = 15823;
+    int prime2 = 9737333;
+
+    uint hash = abs((cell_coord.x * prime1) ^ (cell_coord.y * prime2));
+    return hash % bucket_count;
 }
 
-float2 gradient(float r, float2 dir_to_center) {
-    return -smoothingWeightDerivative(r) * dir_to_center;
+float2 densityToPressure(float density, float near_density) {
+    float pressure = (density - target_density) * pressure_multiplier;
+    float near_pressure = near_density * near_pressure_multiplier;
+    return (float2)(pressure, near_pressure);
 }
 
-int2 positionToCellCoord(float2 pos) {
-    const float cell_width = 2 * h; 
-    int2 cell_coord; 
+// Grid build, same counting sort as SpatialGrid::updateFromCellKeys. The
+// lookup must be zeroed before countCells.
+__kernel void countCells(__global const int *cell_keys, __global int *spatial_lookup, uint particle_count) {
+    uint p_i = get_global_id(0);
+    if (p_i >= particle_count)
+        return;
 
-    cell_coord.x = convert_int(pos.x / cell_width); 
-    cell_coord.y = convert_int(pos.x / cell_width);
+    atomic_inc(&spatial_lookup[cell_keys[p_i]]);
+}
 
-    return cell_coord;
+// Single work item, the prefix sum is cheap next to the neighbour queries.
+__kernel void scanCells(__global int *spatial_lookup, uint bucket_count) {
+    for (uint i = 1; i <= bucket_count; i++) {
+        spatial_lookup[i] += spatial_lookup[i - 1];
+    }
 }
 
-int cellCoordToHash(int2 cell_coord) {
-    int prime1 = 15823;
-    int prime2 = 9737333;
+__kernel void fillCells(__global const int *cell_keys, __global int *spatial_lookup, __global int *spatial_indicies, uint particle_count) {
+    uint p_i = get_global_id(0);
+    if (p_i >= particle_count)
+        return;
 
-    int hash = (cell_coord.x * prime1) ^ (cell_coord.y * prime2);
-    
-    // Subtract 1 for the overflow cell.
-    return hash % (spatial_bucket_count - 1);
+    // Leaves spatial_lookup[key] at the start of the bucket.
+    int i = atomic_dec(&spatial_lookup[cell_keys[p_i]]) - 1;
+    spatial_indicies[i] = p_i;
 }
 
-__kernel void calcDensity(__global float2 *positions, __global float *densities, __global int *spatial_lookup, __global int *spatial_indicies) {  
-    int query[particle_count]; 
-    unsigned int query_size = 0;
+// Gather particles into cell order so each sub-device slab holds spatially
+// close particles. Afterwards slot i is in bucket order, so the index list
+// becomes the identity.
+__kernel void reorderParticles(__global const float2 *positions, __global const float2 *velocities, __global const int *cell_keys, __global const int *particle_ids, __global float2 *sorted_positions, __global float2 *sorted_velocities, __global int *sorted_cell_keys, __global int *sorted_particle_ids, __global int *spatial_indicies, uint particle_count) {
+    uint i = get_global_id(0);
+    if (i >= particle_count)
+        return;
+
+    int src = spatial_indicies[i];
+    sorted_positions[i] = positions[src];
+    sorted_velocities[i] = velocities[src];
+    sorted_cell_keys[i] = cell_keys[src];
+    sorted_particle_ids[i] = particle_ids[src];
+    spatial_indicies[i] = i;
+}
 
-    unsigned int p_i = get_global_id(0);
-    int2 cell_coord = positionToCellCoord(positions[p_i]); 
-    int hash = cellCoordToHash(cell_coord);
+__kernel void calcDensity(__global const float2 *positions, __global float2 *densities, __global const int *spatial_lookup, __global const int *spatial_indicies, uint particle_count, uint bucket_count) {
+    uint p_i = get_global_id(0);
+    if (p_i >= particle_count)
+        return;
+
+    float2 pos = positions[p_i];
+    int2 cell_coord = positionToCellCoord(pos);
+
+    float density = 0.0f;
+    float density_near = 0.0f;
 
-    // Get neighbours
     for (int y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
         for (int x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
-            int2 curr_cell_coord = (int2)(x, y);
-            int curr_hash = cellCoordToHash(curr_cell_coord);
+            int curr_hash = cellCoordToHash((int2)(x, y), bucket_count);
 
             int start = spatial_lookup[curr_hash];
-            int end = spatial_lookup[curr_hash+1];
+            int end = spatial_lookup[curr_hash + 1];
 
-            for (int i = start; i <= end; i++) {
-                 query[query_size] = spatial_indicies[i];
-                 query_size++;
+            for (int i = start; i < end; i++) {
+                const float r = distance(pos, positions[spatial_indicies[i]]);
+                if (r < h) {
+                    density += particle_mass * poly6Kernel(r);
+                }
             }
         }
     }
 
-    float density = 0.0f;
-
-    // Note that mass = 1
-    for (int i = 0; i < query_size; i++) {
-        const float dist = distance(positions[p_i], positions[query[i]]);
-        if (dist < h) {
-            density += densities[query[i]] * smoothingWeight(dist); 
-        }
-    }
-
-    densities[p_i] = density;
+    densities[p_i] = (float2)(density, density_near);
 }
 
-float densityToPressure(float density) {
-    return (density - target_density) * pressure_multiplier; 
-}
+__kernel void applyFluidForces(__global const float2 *positions, __global const float2 *velocities, __global float2 *forces, __global const float2 *densities, __global const int *spatial_lookup, __global const int *spatial_indicies, uint particle_count, uint bucket_count) {
+    uint p_i = get_global_id(0);
+    if (p_i >= particle_count)
+        return;
 
-__kernel void applyPressureForce(__global float2 *positions, __global float2 *velocities, __global float *densities, __global int *spatial_lookup, __global int *spatial_indicies, float dt) {
-    int query[particle_count]; 
-    unsigned int query_size = 0;
+    float2 pos = positions[p_i];
+    float2 vel = velocities[p_i];
+    int2 cell_coord = positionToCellCoord(pos);
 
-    unsigned int p_i = get_global_id(0);
-    int2 cell_coord = positionToCellCoord(positions[p_i]); 
-    int hash = cellCoordToHash(cell_coord);
+    float2 pressure_force = (float2)(0.0f, 0.0f);
+    float2 visc_force = (float2)(0.0f, 0.0f);
+
+    float curr_density = densities[p_i].x;
+    float curr_pressure = densityToPressure(curr_density, densities[p_i].y).x;
 
-    // Get neighbours
     for (int y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
         for (int x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
-            int2 curr_cell_coord = (int2)(x, y);
-            int curr_hash = cellCoordToHash(curr_cell_coord);
+            int curr_hash = cellCoordToHash((int2)(x, y), bucket_count);
 
             int start = spatial_lookup[curr_hash];
-            int end = spatial_lookup[curr_hash+1];
+            int end = spatial_lookup[curr_hash + 1];
+
+            for (int i = start; i < end; i++) {
+                uint n_i = spatial_indicies[i];
+                // Skip self
+                if (n_i == p_i)
+                    continue;
+
+                const float r = distance(pos, positions[n_i]);
+                if (r < h) {
+                    float neighbour_density = densities[n_i].x;
+                    float neighbour_pressure = densityToPressure(neighbour_density, densities[n_i].y).x;
+                    float shared_pressure = 0.5f * (curr_pressure + neighbour_pressure);
 
-            for (int i = start; i <= end; i++) {
-                 query[query_size] = spatial_indicies[i];
-                 query_size++;
+                    float2 rij = normalize(positions[n_i] - pos);
+
+                    pressure_force += -rij * particle_mass * spikyGradKernel(r) * shared_pressure / neighbour_density;
+                    visc_force += particle_mass * laplacianKernel(r) * (velocities[n_i] - vel) / neighbour_density;
+                }
             }
         }
     }
 
-    float2 pressure_force = (float2)(0.0f, 0.0f);
+    visc_force *= viscosity_strength;
 
-    // Note that mass = 1
-    for (int i = 0; i < query_size; i++) {
-        const float dist = distance(positions[p_i], positions[query[i]]);
-        if (dist < h) {
-            float shared_pressure = (densityToPressure(densities[query[i]]) + densityToPressure(densities[p_i])) / 2.0f; 
-            pressure_force += shared_pressure * smoothingWeightDerivative(dist) / densities[query[i]]; 
-        }
+    float2 grav_force = (float2)(0.0f, -9.81f) * particle_mass / curr_density;
+    forces[p_i] = pressure_force + visc_force + grav_force;
+}
+
+// Integrate, constrain to the screen and key the next cell, mirrors
+// PhysicSolver::integrateAndConstrain.
+__kernel void integrate(__global float2 *positions, __global float2 *velocities, __global const float2 *forces, __global const float2 *densities, __global int *cell_keys, uint particle_count, uint bucket_count, float2 world_size, float particle_radius, float dt) {
+    uint p_i = get_global_id(0);
+    if (p_i >= particle_count)
+        return;
+
+    float2 vel = velocities[p_i] + forces[p_i] / densities[p_i].x * dt;
+    float2 pos = positions[p_i] + vel * dt;
+
+    // Right/left
+    if (pos.x + particle_radius > world_size.x) {
+        pos.x = world_size.x - particle_radius;
+        vel.x *= -1.0f * boundary_damping;
+    } else if (pos.x - particle_radius < 0.0f) {
+        pos.x = particle_radius;
+        vel.x *= -1.0f * boundary_damping;
     }
 
-    // F = ma but here we are finding the force of small volumes of water so we use density (which is the mass per volume) as mass here instead.
-    velocities[p_i] += pressure_force / densities[p_i] * dt;
-}
+    // Top/bottom
+    if (pos.y + particle_radius > world_size.y) {
+        pos.y = world_size.y - particle_radius;
+        vel.y *= -1.0f * boundary_damping;
+    } else if (pos.y - particle_radius < 0.0f) {
+        pos.y = particle_radius;
+        vel.y *= -1.0f * boundary_damping;
+    }
 
+    positions[p_i] = pos;
+    velocities[p_i] = vel;
+    cell_keys[p_i] = cellCoordToHash(positionToCellCoord(pos), bucket_count);
+}
@@ -2,32 +2,52 @@
 #include <CL/cl2.hpp>
 #include <iostream>
 #include <stdexcept>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <sstream>
 
-GpuCompute::GpuCompute(std::string file_path) {
-  // Get the default platform (driver).
-  std::vector<cl::Platform> all_platforms;
-  cl::Platform::get(&all_platforms);
-  if (all_platforms.size() == 0) {
-    throw std::runtime_error("No platforms found. Check OpenCL installation!");
+// Built program binaries, one file per device/driver/options/source.
+const std::string program_cache_dir = "./.cl_cache";
+
+// Wait list of the events that have actually been enqueued.
+static std::vector<cl::Event> waitList(std::initializer_list<cl::Event> events) {
+  std::vector<cl::Event> list;
+  for (const cl::Event &event : events) {
+    if (event() != nullptr) {
+      list.push_back(event);
+    }
   }
-  this->platform = all_platforms[0];
-  std::cout << "Using platform: " << this->platform.getInfo<CL_PLATFORM_NAME>()
-            << "\n";
+  return list;
+}
+
+GpuCompute::GpuCompute(std::string file_path, std::string build_options,
+                       const GpuComputeOptions &options)
+    : profiling(options.profiling) {
+  this->selectDevice(options);
 
-  // Get the default device (gpu) for the default platform.
-  std::vector<cl::Device> all_devices;
-  this->platform.getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
-  if (all_devices.size() == 0) {
-    throw std::runtime_error("No devices found. Check OpenCL installation!");
+  // Optionally split into one sub-device per NUMA node so each works on
+  // memory local to its socket.
+  this->devices = {this->device};
+  if (options.numa_fission) {
+    const cl_device_partition_property properties[] = {
+        CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+        CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+    std::vector<cl::Device> sub_devices;
+    if (this->device.createSubDevices(properties, &sub_devices) ==
+            CL_SUCCESS &&
+        sub_devices.size() > 1) {
+      this->devices = sub_devices;
+      std::cout << "Split device into " << sub_devices.size()
+                << " NUMA sub-devices\n";
+    } else {
+      std::cout << "NUMA partitioning unavailable, using the whole device\n";
+    }
   }
-  this->device = all_devices[0];
-  std::cout << "Using device: " << this->device.getInfo<CL_DEVICE_NAME>()
-            << "\n";
+  this->sort_particles = this->devices.size() > 1;
 
   // Create compute context.
-  this->context = cl::Context({this->device});
+  this->context = cl::Context(this->devices);
 
   // Read kernel source code from file.
   cl::Program::Sources sources;
@@ -47,15 +67,470 @@ GpuCompute::GpuCompute(std::string file_path) {
   std::string source_code = ss.str();
   sources.push_back({source_code.c_str(), source_code.size()});
 
-  // Compile source to create GPU program.
-  this->program = cl::Program(this->context, sources);
-  if (program.build({this->device}) != CL_SUCCESS) {
-    std::stringstream msg;
-    msg << "Error building: "
-        << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(this->device);
-    throw std::runtime_error(msg.str());
+  // A binary is only valid for the exact device, driver, options and source.
+  std::stringstream cache_key;
+  cache_key << this->device.getInfo<CL_DEVICE_NAME>() << "\n"
+            << this->device.getInfo<CL_DRIVER_VERSION>() << "\n"
+            << build_options << "\n"
+            << source_code;
+  std::stringstream cache_path;
+  cache_path << program_cache_dir << "/" << std::hex
+             << std::hash<std::string>{}(cache_key.str()) << ".bin";
+
+  if (this->loadProgramBinary(cache_path.str(), build_options)) {
+    std::cout << "Loaded cached program: " << cache_path.str() << "\n";
+  } else {
+    // Compile source to create GPU program.
+    this->program = cl::Program(this->context, sources);
+    if (program.build(this->devices, build_options.c_str()) != CL_SUCCESS) {
+      std::stringstream msg;
+      // With fission the parent device isn't among the build targets, the
+      // sub-devices all get the same log.
+      msg << "Error building: "
+          << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(this->devices[0]);
+      throw std::runtime_error(msg.str());
+    }
+    this->saveProgramBinary(cache_path.str());
+  }
+
+  // Create queue for sending buffers and running kernels. Out of order
+  // queues only respect the event dependencies given in step(), which an
+  // in order queue satisfies too, so devices without support fall back.
+  for (const cl::Device &queue_device : this->devices) {
+    cl_command_queue_properties queue_properties = 0;
+    if (options.out_of_order) {
+      const cl_command_queue_properties supported =
+          queue_device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>();
+      if (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) {
+        queue_properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+      } else {
+        std::cout << "Out of order queues unsupported by "
+                  << queue_device.getInfo<CL_DEVICE_NAME>()
+                  << ", using an in order queue\n";
+      }
+    }
+    if (this->profiling) {
+      queue_properties |= CL_QUEUE_PROFILING_ENABLE;
+    }
+    cl_int err = CL_SUCCESS;
+    this->queues.push_back(
+        cl::CommandQueue(this->context, queue_device, queue_properties, &err));
+    if (err != CL_SUCCESS) {
+      std::stringstream msg;
+      msg << "Error creating command queue: " << err;
+      throw std::runtime_error(msg.str());
+    }
   }
+  this->queue = this->queues[0];
+
+  this->count_cells_kernel = cl::Kernel(this->program, "countCells");
+  this->scan_cells_kernel = cl::Kernel(this->program, "scanCells");
+  this->fill_cells_kernel = cl::Kernel(this->program, "fillCells");
+  this->reorder_particles_kernel =
+      cl::Kernel(this->program, "reorderParticles");
+  this->calc_density_kernel = cl::Kernel(this->program, "calcDensity");
+  this->apply_fluid_forces_kernel =
+      cl::Kernel(this->program, "applyFluidForces");
+  this->integrate_kernel = cl::Kernel(this->program, "integrate");
+}
+
+void GpuCompute::selectDevice(const GpuComputeOptions &options) {
+  std::vector<cl::Platform> all_platforms;
+  cl::Platform::get(&all_platforms);
+  if (all_platforms.size() == 0) {
+    throw std::runtime_error("No platforms found. Check OpenCL installation!");
+  }
+
+  // First device on any platform matching the requested type and name.
+  for (const cl::Platform &curr_platform : all_platforms) {
+    std::vector<cl::Device> all_devices;
+    curr_platform.getDevices(options.device_type, &all_devices);
+
+    for (const cl::Device &curr_device : all_devices) {
+      const std::string name = curr_device.getInfo<CL_DEVICE_NAME>();
+      if (options.device_name.empty() ||
+          name.find(options.device_name) != std::string::npos) {
+        this->platform = curr_platform;
+        this->device = curr_device;
+        std::cout << "Using platform: "
+                  << this->platform.getInfo<CL_PLATFORM_NAME>() << "\n";
+        std::cout << "Using device: " << name << "\n";
+        return;
+      }
+    }
+  }
+
+  throw std::runtime_error("No devices found matching '" +
+                           options.device_name +
+                           "'. Check OpenCL installation!");
+}
+
+bool GpuCompute::loadProgramBinary(const std::string &path,
+                                   const std::string &build_options) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open()) {
+    return false;
+  }
+
+  std::vector<unsigned char> binary((std::istreambuf_iterator<char>(file)),
+                                    std::istreambuf_iterator<char>());
+  // Sub-devices of one device share the same binary.
+  cl::Program::Binaries binaries(this->devices.size(), binary);
+
+  cl_int err;
+  std::vector<cl_int> binary_status;
+  this->program = cl::Program(this->context, this->devices, binaries,
+                              &binary_status, &err);
+  if (err != CL_SUCCESS ||
+      this->program.build(this->devices, build_options.c_str()) !=
+          CL_SUCCESS) {
+    // Stale or corrupt, fall back to building from source.
+    std::cerr << "Ignoring unusable cached program: " << path << "\n";
+    return false;
+  }
+  return true;
+}
+
+void GpuCompute::saveProgramBinary(const std::string &path) {
+  cl::Program::Binaries binaries =
+      this->program.getInfo<CL_PROGRAM_BINARIES>();
+  if (binaries.empty() || binaries[0].empty()) {
+    return;
+  }
+
+  std::error_code err;
+  std::filesystem::create_directories(program_cache_dir, err);
+  std::ofstream file(path, std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Failed to write program cache: " << path << "\n";
+    return;
+  }
+  file.write((const char *)binaries[0].data(), binaries[0].size());
+}
+
+void GpuCompute::uploadParticles(Particles &particles,
+                                 std::vector<int32_t> &_cell_keys,
+                                 const uint32_t _bucket_count,
+                                 const glm::vec2 world_size,
+                                 const float particle_radius) {
+  this->particle_count = particles.particle_count;
+  this->bucket_count = _bucket_count;
+  this->staging_positions.resize(this->particle_count);
+  this->staging_velocities.resize(this->particle_count);
+  this->staging_particle_ids.resize(this->particle_count);
+
+  const size_t vec2_bytes = sizeof(glm::vec2) * this->particle_count;
+  const size_t int_bytes = sizeof(int32_t) * this->particle_count;
+
+  this->positions = cl::Buffer(this->context,
+                               CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                               vec2_bytes, particles.positions.data());
+  this->velocities = cl::Buffer(this->context,
+                                CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                vec2_bytes, particles.velocities.data());
+  this->forces = cl::Buffer(this->context, CL_MEM_READ_WRITE, vec2_bytes);
+  this->densities = cl::Buffer(this->context, CL_MEM_READ_WRITE, vec2_bytes);
+  this->cell_keys = cl::Buffer(this->context,
+                               CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                               int_bytes, _cell_keys.data());
+  this->spatial_lookup =
+      cl::Buffer(this->context, CL_MEM_READ_WRITE,
+                 sizeof(int32_t) * (this->bucket_count + 1));
+  this->spatial_indicies =
+      cl::Buffer(this->context, CL_MEM_READ_WRITE, int_bytes);
+
+  if (this->sort_particles) {
+    std::vector<int32_t> ids(this->particle_count);
+    for (uint32_t i = 0; i < this->particle_count; i++) {
+      ids[i] = i;
+    }
+    this->particle_ids = cl::Buffer(this->context,
+                                    CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                    int_bytes, ids.data());
+    this->sorted_positions =
+        cl::Buffer(this->context, CL_MEM_READ_WRITE, vec2_bytes);
+    this->sorted_velocities =
+        cl::Buffer(this->context, CL_MEM_READ_WRITE, vec2_bytes);
+    this->sorted_cell_keys =
+        cl::Buffer(this->context, CL_MEM_READ_WRITE, int_bytes);
+    this->sorted_particle_ids =
+        cl::Buffer(this->context, CL_MEM_READ_WRITE, int_bytes);
+  }
+
+  // Split the particles into one contiguous slab per device, sized by its
+  // compute units.
+  uint32_t total_units = 0;
+  for (const cl::Device &slab_device : this->devices) {
+    total_units += slab_device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+  }
+  this->slab_starts = {0};
+  uint32_t units_so_far = 0;
+  for (const cl::Device &slab_device : this->devices) {
+    units_so_far += slab_device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    this->slab_starts.push_back(
+        total_units == 0 ? this->particle_count
+                         : (uint64_t)this->particle_count * units_so_far /
+                               total_units);
+  }
+  this->slab_starts.back() = this->particle_count;
+  // Fewer particles than devices or compute units leaves some slabs empty.
+  this->active_slabs.clear();
+  for (uint32_t k = 0; k < this->devices.size(); k++) {
+    if (this->slab_starts[k + 1] > this->slab_starts[k]) {
+      this->active_slabs.push_back(k);
+    }
+  }
+
+  this->bindKernelArgs();
+
+  // Scene parameters, never rebound.
+  this->integrate_kernel.setArg(7, cl_float2{{world_size.x, world_size.y}});
+  this->integrate_kernel.setArg(8, particle_radius);
+}
+
+void GpuCompute::bindKernelArgs() {
+  // Only dt changes per step, but buffers are swapped by the cell sort.
+  const cl_uint count = this->particle_count;
+  const cl_uint buckets = this->bucket_count;
 
-  // Create queue for sending buffers and running kernels.
-  this->queue = cl::CommandQueue(this->context, this->device);
+  this->count_cells_kernel.setArg(0, this->cell_keys);
+  this->count_cells_kernel.setArg(1, this->spatial_lookup);
+  this->count_cells_kernel.setArg(2, count);
+
+  this->scan_cells_kernel.setArg(0, this->spatial_lookup);
+  this->scan_cells_kernel.setArg(1, buckets);
+
+  this->fill_cells_kernel.setArg(0, this->cell_keys);
+  this->fill_cells_kernel.setArg(1, this->spatial_lookup);
+  this->fill_cells_kernel.setArg(2, this->spatial_indicies);
+  this->fill_cells_kernel.setArg(3, count);
+
+  if (this->sort_particles) {
+    this->reorder_particles_kernel.setArg(0, this->positions);
+    this->reorder_particles_kernel.setArg(1, this->velocities);
+    this->reorder_particles_kernel.setArg(2, this->cell_keys);
+    this->reorder_particles_kernel.setArg(3, this->particle_ids);
+    this->reorder_particles_kernel.setArg(4, this->sorted_positions);
+    this->reorder_particles_kernel.setArg(5, this->sorted_velocities);
+    this->reorder_particles_kernel.setArg(6, this->sorted_cell_keys);
+    this->reorder_particles_kernel.setArg(7, this->sorted_particle_ids);
+    this->reorder_particles_kernel.setArg(8, this->spatial_indicies);
+    this->reorder_particles_kernel.setArg(9, count);
+  }
+
+  this->calc_density_kernel.setArg(0, this->positions);
+  this->calc_density_kernel.setArg(1, this->densities);
+  this->calc_density_kernel.setArg(2, this->spatial_lookup);
+  this->calc_density_kernel.setArg(3, this->spatial_indicies);
+  this->calc_density_kernel.setArg(4, count);
+  this->calc_density_kernel.setArg(5, buckets);
+
+  this->apply_fluid_forces_kernel.setArg(0, this->positions);
+  this->apply_fluid_forces_kernel.setArg(1, this->velocities);
+  this->apply_fluid_forces_kernel.setArg(2, this->forces);
+  this->apply_fluid_forces_kernel.setArg(3, this->densities);
+  this->apply_fluid_forces_kernel.setArg(4, this->spatial_lookup);
+  this->apply_fluid_forces_kernel.setArg(5, this->spatial_indicies);
+  this->apply_fluid_forces_kernel.setArg(6, count);
+  this->apply_fluid_forces_kernel.setArg(7, buckets);
+
+  this->integrate_kernel.setArg(0, this->positions);
+  this->integrate_kernel.setArg(1, this->velocities);
+  this->integrate_kernel.setArg(2, this->forces);
+  this->integrate_kernel.setArg(3, this->densities);
+  this->integrate_kernel.setArg(4, this->cell_keys);
+  this->integrate_kernel.setArg(5, count);
+  this->integrate_kernel.setArg(6, buckets);
+}
+
+void GpuCompute::step(const float dt) {
+  const cl::NDRange global(this->particle_count);
+  cl::Event fill_event, count_event, scan_event, fill_cells_event;
+
+  // Grid. The lookup may still be read by the previous force pass and the
+  // keys come from the previous integrate. Neither touches positions or
+  // velocities, so this overlaps with a pending readback.
+  std::vector<cl::Event> deps = waitList({this->last_forces});
+  this->queue.enqueueFillBuffer(this->spatial_lookup, (cl_int)0, 0,
+                                sizeof(int32_t) * (this->bucket_count + 1),
+                                &deps, &fill_event);
+  deps = waitList({fill_event, this->last_integrate});
+  this->queue.enqueueNDRangeKernel(this->count_cells_kernel, cl::NullRange,
+                                   global, cl::NullRange, &deps, &count_event);
+  deps = {count_event};
+  this->queue.enqueueNDRangeKernel(this->scan_cells_kernel, cl::NullRange,
+                                   cl::NDRange(1), cl::NullRange, &deps,
+                                   &scan_event);
+  deps = {scan_event};
+  this->queue.enqueueNDRangeKernel(this->fill_cells_kernel, cl::NullRange,
+                                   global, cl::NullRange, &deps,
+                                   &fill_cells_event);
+  cl::Event grid_event = fill_cells_event;
+
+  this->record("fillBuffer", fill_event);
+  this->record("countCells", count_event);
+  this->record("scanCells", scan_event);
+  this->record("fillCells", fill_cells_event);
+
+  if (this->sort_particles) {
+    // Gather into cell order so every slab is a contiguous block of nearby
+    // particles. Writes the buffers a pending readback may be reading.
+    cl::Event reorder_event;
+    deps = waitList({fill_cells_event, this->pending_readback});
+    this->queue.enqueueNDRangeKernel(this->reorder_particles_kernel,
+                                     cl::NullRange, global, cl::NullRange,
+                                     &deps, &reorder_event);
+    std::swap(this->positions, this->sorted_positions);
+    std::swap(this->velocities, this->sorted_velocities);
+    std::swap(this->cell_keys, this->sorted_cell_keys);
+    std::swap(this->particle_ids, this->sorted_particle_ids);
+    this->bindKernelArgs();
+
+    grid_event = reorder_event;
+    this->record("reorderParticles", reorder_event);
+  }
+
+  // Density, forces, integrate, one slab per device. Forces read neighbour
+  // densities from every slab and integrate moves particles every slab
+  // reads, so each pass waits for all slabs of the previous one.
+  // Events are indexed like active_slabs, empty slabs enqueue nothing.
+  const uint32_t slab_count = this->active_slabs.size();
+  std::vector<cl::Event> density_events(slab_count);
+  std::vector<cl::Event> forces_events(slab_count);
+  std::vector<cl::Event> integrate_events(slab_count);
+  this->integrate_kernel.setArg(9, dt);
+
+  deps = {grid_event};
+  for (uint32_t a = 0; a < slab_count; a++) {
+    const uint32_t k = this->active_slabs[a];
+    const cl::NDRange offset(this->slab_starts[k]);
+    const cl::NDRange size(this->slab_starts[k + 1] - this->slab_starts[k]);
+    this->queues[k].enqueueNDRangeKernel(this->calc_density_kernel, offset,
+                                         size, cl::NullRange, &deps,
+                                         &density_events[a]);
+  }
+
+  for (uint32_t a = 0; a < slab_count; a++) {
+    const uint32_t k = this->active_slabs[a];
+    const cl::NDRange offset(this->slab_starts[k]);
+    const cl::NDRange size(this->slab_starts[k + 1] - this->slab_starts[k]);
+    this->queues[k].enqueueNDRangeKernel(this->apply_fluid_forces_kernel,
+                                         offset, size, cl::NullRange,
+                                         &density_events, &forces_events[a]);
+  }
+
+  // Must not overwrite positions/velocities while they are being read back.
+  deps = forces_events;
+  if (this->pending_readback() != nullptr) {
+    deps.push_back(this->pending_readback);
+  }
+  for (uint32_t a = 0; a < slab_count; a++) {
+    const uint32_t k = this->active_slabs[a];
+    const cl::NDRange offset(this->slab_starts[k]);
+    const cl::NDRange size(this->slab_starts[k + 1] - this->slab_starts[k]);
+    this->queues[k].enqueueNDRangeKernel(this->integrate_kernel, offset, size,
+                                         cl::NullRange, &deps,
+                                         &integrate_events[a]);
+  }
+
+  // Single events standing for all slabs.
+  this->queue.enqueueMarkerWithWaitList(&forces_events, &this->last_forces);
+  this->queue.enqueueMarkerWithWaitList(&integrate_events,
+                                        &this->last_integrate);
+  for (cl::CommandQueue &slab_queue : this->queues) {
+    slab_queue.flush();
+  }
+
+  for (uint32_t a = 0; a < slab_count; a++) {
+    const std::string slab =
+        "[" + std::to_string(this->active_slabs[a]) + "]";
+    this->record("calcDensity" + slab, density_events[a]);
+    this->record("applyFluidForces" + slab, forces_events[a]);
+    this->record("integrate" + slab, integrate_events[a]);
+  }
+}
+
+void GpuCompute::downloadParticles(Particles &particles) {
+  // Read through the staging buffers so cell sorted slots get mapped back.
+  this->collectParticles(particles);
+  this->readParticlesAsync();
+  this->collectParticles(particles);
+}
+
+void GpuCompute::readParticlesAsync() {
+  const size_t vec2_bytes = sizeof(glm::vec2) * this->particle_count;
+  const size_t int_bytes = sizeof(int32_t) * this->particle_count;
+  std::vector<cl::Event> deps = waitList({this->last_integrate});
+  std::vector<cl::Event> read_events(2);
+
+  this->queue.enqueueReadBuffer(this->positions, CL_FALSE, 0, vec2_bytes,
+                                this->staging_positions.data(), &deps,
+                                &read_events[0]);
+  this->queue.enqueueReadBuffer(this->velocities, CL_FALSE, 0, vec2_bytes,
+                                this->staging_velocities.data(), &deps,
+                                &read_events[1]);
+  if (this->sort_particles) {
+    read_events.push_back(cl::Event());
+    this->queue.enqueueReadBuffer(this->particle_ids, CL_FALSE, 0, int_bytes,
+                                  this->staging_particle_ids.data(), &deps,
+                                  &read_events[2]);
+  }
+  // One event covering all reads.
+  this->queue.enqueueMarkerWithWaitList(&read_events, &this->pending_readback);
+  this->queue.flush();
+
+  this->record("readPositions", read_events[0]);
+  this->record("readVelocities", read_events[1]);
+}
+
+bool GpuCompute::collectParticles(Particles &particles) {
+  if (this->pending_readback() == nullptr) {
+    return false;
+  }
+  this->pending_readback.wait();
+  this->pending_readback = cl::Event();
+
+  if (this->sort_particles) {
+    // Device slots are in cell order, host particles stay in id order.
+    for (uint32_t i = 0; i < this->particle_count; i++) {
+      const int32_t p_i = this->staging_particle_ids[i];
+      particles.positions[p_i] = this->staging_positions[i];
+      particles.velocities[p_i] = this->staging_velocities[i];
+    }
+    return true;
+  }
+
+  // Swap rather than copy, the old arrays become the next staging buffers.
+  particles.positions.swap(this->staging_positions);
+  particles.velocities.swap(this->staging_velocities);
+  return true;
+}
+
+void GpuCompute::record(const std::string &name, const cl::Event &event) {
+  if (this->profiling) {
+    this->timeline.push_back({name, event});
+  }
+}
+
+void GpuCompute::printTimeline() {
+  // Only completed commands have timestamps, keep the rest for next time.
+  std::vector<std::pair<std::string, cl::Event>> running;
+
+  for (auto &[name, event] : this->timeline) {
+    if (event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+      running.push_back({name, event});
+      continue;
+    }
+
+    const cl_ulong start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    const cl_ulong end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+    if (this->timeline_origin == 0) {
+      this->timeline_origin = start;
+    }
+
+    std::cout << "CL " << name << ": " << (start - this->timeline_origin) / 1e3
+              << " us -> " << (end - this->timeline_origin) / 1e3 << " us ("
+              << (end - start) / 1e3 << " us)\n";
+  }
+  this->timeline.swap(running);
 }
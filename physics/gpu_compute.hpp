@@ -2,12 +2,110 @@
 #define CL_HPP_TARGET_OPENCL_VERSION 210
 #include <CL/cl2.hpp>
 
+#include <glm/glm.hpp>
+
+#include "particles.hpp"
+
+struct GpuComputeOptions {
+  // Use the first device whose name contains device_name (any when empty)
+  // and whose type matches device_type.
+  std::string device_name;
+  cl_device_type device_type = CL_DEVICE_TYPE_ALL;
+  bool out_of_order = true;
+  bool profiling = false;
+  // Split the device into one sub-device per NUMA node. Particles are kept
+  // sorted by cell on the device and each sub-device owns a contiguous slab.
+  bool numa_fission = false;
+};
+
 struct GpuCompute {
   cl::Platform platform;
   cl::Device device;
   cl::Context context;
   cl::Program program;
+  // Grid build and transfers go through queue, which is queues[0]. Per
+  // particle kernels run on every queue, one per (sub-)device.
   cl::CommandQueue queue;
+  std::vector<cl::Device> devices;
+  std::vector<cl::CommandQueue> queues;
+
+  // Particle state, lives on the device between steps.
+  uint32_t particle_count;
+  uint32_t bucket_count;
+  cl::Buffer positions;
+  cl::Buffer velocities;
+  cl::Buffer forces;
+  cl::Buffer densities;
+  cl::Buffer cell_keys;
+  cl::Buffer spatial_lookup;
+  cl::Buffer spatial_indicies;
+
+  // Cell sorting, only used with sub-devices. particle_ids maps each device
+  // slot back to the host particle index.
+  bool sort_particles;
+  cl::Buffer particle_ids;
+  cl::Buffer sorted_positions;
+  cl::Buffer sorted_velocities;
+  cl::Buffer sorted_cell_keys;
+  cl::Buffer sorted_particle_ids;
+  // slab_starts[k]..slab_starts[k + 1] is owned by devices[k].
+  std::vector<uint32_t> slab_starts;
+  // Slabs holding at least one particle, an empty NDRange is an error.
+  std::vector<uint32_t> active_slabs;
+
+  cl::Kernel count_cells_kernel;
+  cl::Kernel scan_cells_kernel;
+  cl::Kernel fill_cells_kernel;
+  cl::Kernel reorder_particles_kernel;
+  cl::Kernel calc_density_kernel;
+  cl::Kernel apply_fluid_forces_kernel;
+  cl::Kernel integrate_kernel;
+
+  // Last commands touching each resource, used as explicit dependencies so
+  // an out of order queue can overlap independent work.
+  cl::Event last_forces;
+  cl::Event last_integrate;
+  cl::Event pending_readback;
+  std::vector<glm::vec2> staging_positions;
+  std::vector<glm::vec2> staging_velocities;
+  std::vector<int32_t> staging_particle_ids;
+
+  // Per command timeline from CL_QUEUE_PROFILING_ENABLE.
+  bool profiling;
+  std::vector<std::pair<std::string, cl::Event>> timeline;
+  cl_ulong timeline_origin = 0;
+
+  // build_options carries the scene constants as -D defines, so each
+  // parameter set gets its own specialised and cached program.
+  GpuCompute(std::string file_path, std::string build_options,
+             const GpuComputeOptions &options);
+
+  void selectDevice(const GpuComputeOptions &options);
+
+  bool loadProgramBinary(const std::string &path,
+                         const std::string &build_options);
+
+  void saveProgramBinary(const std::string &path);
+
+  void uploadParticles(Particles &particles, std::vector<int32_t> &_cell_keys,
+                       const uint32_t _bucket_count, const glm::vec2 world_size,
+                       const float particle_radius);
+
+  void bindKernelArgs();
+
+  void step(const float dt);
+
+  // Blocking read of the latest state.
+  void downloadParticles(Particles &particles);
+
+  // Queue a read of the latest state into staging buffers.
+  void readParticlesAsync();
+
+  // Wait for the queued read and move it into particles. Returns false if
+  // nothing was queued.
+  bool collectParticles(Particles &particles);
+
+  void record(const std::string &name, const cl::Event &event);
 
-  GpuCompute(std::string file_path);
+  void printTimeline();
 };
@@ -1,6 +1,11 @@
 #include "particles.hpp"
 
+#include <numeric>
+
 Particles::Particles(const uint32_t _particle_count)
     : particle_count(_particle_count), positions(_particle_count),
       velocities(_particle_count), forces(_particle_count),
-      densities(_particle_count), colours(_particle_count){};
+      densities(_particle_count), species(_particle_count),
+      ids(_particle_count) {
+  std::iota(this->ids.begin(), this->ids.end(), 0);
+};
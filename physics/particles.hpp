@@ -15,8 +15,11 @@ struct Particles {
   std::vector<glm::vec2> forces;
   std::vector<glm::vec2> densities;
 
-  // Appearance
-  std::vector<glm::vec3> colours;
+  // Appearance, index into the renderer's palette.
+  std::vector<uint8_t> species;
+
+  // Spawn index of each particle, follows it when the arrays are sorted.
+  std::vector<uint32_t> ids;
 
   Particles(const uint32_t _particle_count);
 };
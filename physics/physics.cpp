@@ -1,11 +1,26 @@
 #include "physics.hpp"
 #include "spatial_grid.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <limits>
+#include <numeric>
+#include <random>
 #include <glm/geometric.hpp>
 #include <glm/glm.hpp>
 
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+
+// Fluid parameters shared by the GL and OpenCL kernels.
+const float target_density = 300.f;
+const float pressure_multiplier = 2000.f;
+const float near_pressure_multiplier = 3000.f;
+const float viscosity_strength = 200.f;
+// Fraction of velocity kept when bouncing off the screen edges.
+const float boundary_damping = 0.5f;
 
 PhysicSolver::PhysicSolver(glm::vec2 _screen_size,
                            const uint32_t _particle_count,
@@ -16,7 +31,11 @@ PhysicSolver::PhysicSolver(glm::vec2 _screen_size,
       sub_steps(_sub_steps), particle_count(_particle_count),
       particle_radius(_particle_radius), particle_mass(_particle_mass),
       smoothing_radius(_smoothing_radius),
-      compute_shader("./renderer/shaders/fluid_sim.cs.glsl") {
+      compute_shader("./renderer/shaders/fluid_sim.cs.glsl"),
+      neighbour_counts(_particle_count), dispatch_order(_particle_count) {
+
+  std::random_device random_device;
+  this->run_id = ((uint64_t)random_device() << 32) | random_device();
 
   // WARNING: particle_count must be square
   const glm::ivec2 spawn_grid_size((int32_t)sqrt(this->particle_count),
@@ -32,40 +51,165 @@ PhysicSolver::PhysicSolver(glm::vec2 _screen_size,
           glm::vec2((x + 1) * (2 * this->particle_radius + spawn_grid_spacing),
                     -(y + 1) *
                         (2 * this->particle_radius + spawn_grid_spacing));
-      this->particles.colours[p_i] = glm::vec3(35.f, 137.f, 218.f) / 255.f;
+      this->particles.species[p_i] = 0;
     }
   }
   this->spatial_grid =
       new SpatialGrid(this->particles.positions, this->smoothing_radius);
+  // After this the integrator keeps cell keys up to date.
+  this->spatial_grid->updateCellKeys();
+  this->cpu_compute = new CpuCompute(
+      this->particles, this->spatial_grid, this->smoothing_radius,
+      this->particle_mass, target_density, pressure_multiplier,
+      near_pressure_multiplier, viscosity_strength);
+  // The surface sits at half the density of touching particles, nodes at
+  // half the smoothing radius resolve it.
+  this->surface_extractor = new SurfaceExtractor(
+      this->world_size, 0.5f * this->smoothing_radius, this->smoothing_radius,
+      this->particle_mass,
+      0.5f * SurfaceExtractor::latticeDensity(2.f * this->particle_radius,
+                                              this->smoothing_radius,
+                                              this->particle_mass));
+}
+
+PhysicSolver::~PhysicSolver() {
+  delete this->cpu_compute;
+  delete this->surface_extractor;
+  delete this->spatial_grid;
+  if (this->gpu_timer_query != 0) {
+    glDeleteQueries(1, &this->gpu_timer_query);
+  }
+#ifdef USE_OPENCL
+  delete this->gpu_compute;
+#endif
 }
 
-PhysicSolver::~PhysicSolver() { delete this->spatial_grid; }
+#ifdef USE_OPENCL
+void PhysicSolver::useOpenCl(const std::string &kernel_path) {
+  // Scene constants are compiled into the program.
+  std::stringstream build_options;
+  build_options << std::setprecision(9)
+                << "-DSMOOTHING_RADIUS=" << this->smoothing_radius
+                << " -DPARTICLE_MASS=" << this->particle_mass
+                << " -DTARGET_DENSITY=" << target_density
+                << " -DPRESSURE_MULTIPLIER=" << pressure_multiplier
+                << " -DNEAR_PRESSURE_MULTIPLIER=" << near_pressure_multiplier
+                << " -DVISCOSITY_STRENGTH=" << viscosity_strength
+                << " -DBOUNDARY_DAMPING=" << boundary_damping;
+
+  this->gpu_compute =
+      new GpuCompute(kernel_path, build_options.str(),
+                     this->opencl_options);
+  this->gpu_compute->uploadParticles(
+      this->particles, this->spatial_grid->cell_keys,
+      this->spatial_grid->spatial_lookup.size() - 1, this->world_size,
+      this->particle_radius);
+}
+#endif
 
 void PhysicSolver::update(const float dt) {
   // const float step_dt = dt / this->sub_steps;
   // const float step_dt = (1 / 60.f) / this->sub_steps;
   const float step_dt = 0.0007f;
+  this->gpu_positions_ssbo = 0;
+  const uint64_t uploaded_bytes = this->compute_shader.uploaded_bytes;
+  const uint64_t read_back_bytes = this->compute_shader.read_back_bytes;
+
+#ifdef USE_OPENCL
+  if (this->gpu_compute != nullptr) {
+    for (int32_t i = 0; i < this->sub_steps; i++) {
+      this->gpu_compute->step(step_dt);
+    }
+    // State stays on the device, only read back what is drawn. The read
+    // queued last frame overlapped with the steps above, so drawing lags
+    // the device by one frame.
+    this->gpu_compute->collectParticles(this->particles);
+    this->gpu_compute->readParticlesAsync();
+    if (this->opencl_options.profiling) {
+      this->gpu_compute->printTimeline();
+    }
+    this->publishSnapshot();
+    return;
+  }
+#endif
 
   for (int32_t i = 0; i < this->sub_steps; i++) {
     // applyGravity(step_dt);
 
-    this->spatial_grid->update();
+    this->spatial_grid->updateFromCellKeys();
+    if (this->co_execution) {
+      this->coExecuteDensitiesAndForces(step_dt);
+      this->integrateAndConstrain(step_dt);
+      continue;
+    }
+    if (this->cell_tiled_dispatch) {
+      this->sortParticlesByCell();
+    } else if (this->neighbour_count_scheduling) {
+      this->updateNeighbourCounts();
+      this->updateDispatchOrder();
+    }
     // this->calcDensities(step_dt);
     this->calcDensitiesAndApplyPressureForce(step_dt);
-    // Integrate
-    for (int32_t i = 0; i < this->particle_count; i++) {
-      glm::vec2 acc =
-          this->particles.forces[i] / this->particles.densities[i].x;
-      this->particles.velocities[i] += acc * step_dt;
-      this->particles.positions[i] += this->particles.velocities[i] * step_dt;
+    // The fused GPU step has already integrated, constrained and keyed.
+    if (!this->fused_gpu_step) {
+      this->integrateAndConstrain(step_dt);
     }
+  }
+
+  if (this->gpu_stats) {
+    this->stats_reduction.fetch(this->stats);
+  }
+  if (this->surface_extraction) {
+    // Cell keys are current, the lookup still describes the last sub-step.
+    this->spatial_grid->updateFromCellKeys();
+    this->surface_extractor->extract(this->particles.positions,
+                                     this->spatial_grid, this->reorder_count);
+  }
+  this->update_uploaded_bytes =
+      this->compute_shader.uploaded_bytes - uploaded_bytes;
+  this->update_read_back_bytes =
+      this->compute_shader.read_back_bytes - read_back_bytes;
+  this->publishSnapshot();
+}
+
+void PhysicSolver::publishSnapshot() {
+  this->update_count++;
+  if (!this->publish_snapshots)
+    return;
 
-    this->constrainParticlesToScreen(step_dt);
+  // Assigning reuses each buffer's storage after the first few publishes.
+  ParticleSnapshot &snapshot = this->snapshots.writeBuffer();
+  snapshot.positions = this->particles.positions;
+  snapshot.species = this->particles.species;
+  snapshot.update_count = this->update_count;
+  snapshot.reorder_count = this->reorder_count;
+  snapshot.publish_time =
+      std::chrono::duration<double>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+  this->snapshots.publish();
+}
+
+void PhysicSolver::integrateAndConstrain(const float step_dt) {
+  this->positions_dirty.markAll();
+  this->velocities_dirty.markAll();
+  // Single sweep: integrate, constrain and key the next cell while each
+  // particle is still in cache.
+  for (int32_t i = 0; i < this->particle_count; i++) {
+    glm::vec2 acc = this->particles.forces[i] / this->particles.densities[i].x;
+    this->particles.velocities[i] += acc * step_dt;
+    this->particles.positions[i] += this->particles.velocities[i] * step_dt;
+
+    this->constrainParticleToScreen(i);
+
+    this->spatial_grid->cell_keys[i] = this->spatial_grid->cellCoordToHash(
+        this->spatial_grid->positionToCellCoord(this->particles.positions[i]));
   }
 }
 
 void PhysicSolver::applyGravity(float step_dt) {
   glm::vec2 G(0.0f, -9.81f);
+  this->velocities_dirty.markAll();
   for (int32_t i = 0; i < this->particle_count; i++) {
     this->particles.velocities[i] += G * step_dt;
   }
@@ -89,81 +233,485 @@ void PhysicSolver::calcDensities(const float step_dt) {
   }
 }
 
-void PhysicSolver::calcDensitiesAndApplyPressureForce(const float step_dt) {
-  this->compute_shader.use();
-
-  this->compute_shader.setVector(this->particles.positions, 0);
-  this->compute_shader.setVector(this->particles.velocities, 1);
-  const uint32_t forces_ssbo_id =
-      this->compute_shader.setVector(this->particles.forces, 2);
-  const uint32_t densities_ssbo_id =
-      this->compute_shader.setVector(this->particles.densities, 3);
-  this->compute_shader.setVector(this->spatial_grid->spatial_lookup, 4);
-  this->compute_shader.setVector(this->spatial_grid->spatial_indicies, 5);
-
+void PhysicSolver::setFluidUniforms(const float step_dt) {
   this->compute_shader.setFloat(step_dt, "dt");
   this->compute_shader.setUnsignedInt(this->particle_count, "particle_count");
+  this->compute_shader.setUnsignedInt(this->particle_count, "dispatch_count");
   this->compute_shader.setUnsignedInt(
       this->spatial_grid->spatial_lookup.size() - 1, "bucket_count");
   this->compute_shader.setFloat(this->smoothing_radius, "h");
   this->compute_shader.setFloat(this->particle_mass, "particle_mass");
-  this->compute_shader.setFloat(300.f, "target_density");
-  this->compute_shader.setFloat(2000.f, "pressure_multiplier");
-  this->compute_shader.setFloat(3000.f, "near_pressure_multiplier");
-  this->compute_shader.setFloat(200.f, "viscosity_strength");
+  this->compute_shader.setFloat(target_density, "target_density");
+  this->compute_shader.setFloat(pressure_multiplier, "pressure_multiplier");
+  this->compute_shader.setFloat(near_pressure_multiplier,
+                                "near_pressure_multiplier");
+  this->compute_shader.setFloat(viscosity_strength, "viscosity_strength");
+  this->compute_shader.setVec2(this->world_size, "world_size");
+  this->compute_shader.setFloat(this->particle_radius, "particle_radius");
+  this->compute_shader.setFloat(boundary_damping, "boundary_damping");
+}
+
+template <typename T>
+void PhysicSolver::uploadDirty(std::vector<T> &vec, DirtyRange &range,
+                               const uint32_t binding_id) {
+  const uint32_t end = std::min<uint32_t>(range.end, vec.size());
+  const uint32_t begin = std::min(range.begin, end);
+  this->compute_shader.updateVector(vec, binding_id, begin, end - begin);
+  range.clear();
+}
+
+void PhysicSolver::markChanges(const std::vector<int32_t> &current,
+                               std::vector<int32_t> &uploaded,
+                               DirtyRange &range) {
+  if (uploaded.size() != current.size()) {
+    uploaded = current;
+    range.markAll();
+    return;
+  }
+  // Comparing on the host is far cheaper than sending the whole array.
+  const uint32_t begin =
+      std::mismatch(current.begin(), current.end(), uploaded.begin()).first -
+      current.begin();
+  if (begin == current.size())
+    return;
+  uint32_t end = current.size();
+  while (current[end - 1] == uploaded[end - 1]) {
+    end--;
+  }
+  std::copy(current.begin() + begin, current.begin() + end,
+            uploaded.begin() + begin);
+  range.mark(begin, end);
+}
+
+void PhysicSolver::uploadParticleState() {
+  // Positions and velocities start from the fused step's outputs, copied on
+  // the GPU, with any host writes since then uploaded on top.
+  if (this->state_in_next_buffers) {
+    const size_t bytes = sizeof(glm::vec2) * this->particle_count;
+    this->compute_shader.copyBuffer(this->compute_shader.bindingBuffer(7), 0,
+                                    bytes);
+    this->compute_shader.copyBuffer(this->compute_shader.bindingBuffer(8), 1,
+                                    bytes);
+    this->state_in_next_buffers = false;
+  }
+  this->uploadDirty(this->particles.positions, this->positions_dirty, 0);
+  this->uploadDirty(this->particles.velocities, this->velocities_dirty, 1);
+
+  this->markChanges(this->spatial_grid->spatial_lookup, this->uploaded_lookup,
+                    this->lookup_dirty);
+  this->markChanges(this->spatial_grid->spatial_indicies,
+                    this->uploaded_indicies, this->indicies_dirty);
+  this->uploadDirty(this->spatial_grid->spatial_lookup, this->lookup_dirty, 4);
+  this->uploadDirty(this->spatial_grid->spatial_indicies, this->indicies_dirty,
+                    5);
+}
+
+void PhysicSolver::calcDensitiesAndApplyPressureForce(const float step_dt) {
+  this->compute_shader.use();
+
+  this->uploadParticleState();
+  // Written by the kernels before being read, nothing to upload.
+  const uint32_t forces_ssbo_id =
+      this->compute_shader.createVector<glm::vec2>(this->particle_count, 2);
+  const uint32_t densities_ssbo_id =
+      this->compute_shader.createVector<glm::vec2>(this->particle_count, 3);
+
+  const bool scheduled_dispatch =
+      this->neighbour_count_scheduling && !this->cell_tiled_dispatch;
+  if (scheduled_dispatch) {
+    this->markChanges(this->dispatch_order, this->uploaded_dispatch_order,
+                      this->dispatch_order_dirty);
+    this->uploadDirty(this->dispatch_order, this->dispatch_order_dirty, 9);
+  }
+  this->compute_shader.setUnsignedInt(scheduled_dispatch, "scheduled_dispatch");
+  this->setFluidUniforms(step_dt);
 
   const uint32_t calc_density_kernel_id = 0;
   const uint32_t apply_fluid_forces_kernel_id = 1;
+  const uint32_t calc_density_tiled_kernel_id = 2;
+  const uint32_t apply_fluid_forces_tiled_kernel_id = 3;
+  const uint32_t fused_step_kernel_id = 4;
+  const uint32_t fused_step_tiled_kernel_id = 5;
 
-  // Calculate densities
-  this->compute_shader.setUnsignedInt(calc_density_kernel_id, "kernel_id");
-  this->compute_shader.executeSync(this->particle_count);
+  if (this->fused_gpu_step) {
+    const uint32_t cell_keys_ssbo_id =
+        this->compute_shader.createVector<int32_t>(this->particle_count, 6);
+    const uint32_t next_positions_ssbo_id =
+        this->compute_shader.createVector<glm::vec2>(this->particle_count, 7);
+    const uint32_t next_velocities_ssbo_id =
+        this->compute_shader.createVector<glm::vec2>(this->particle_count, 8);
 
-  // Apply fluid forces
-  this->compute_shader.setUnsignedInt(apply_fluid_forces_kernel_id,
-                                      "kernel_id");
-  this->compute_shader.executeSync(this->particle_count);
+    if (this->cell_tiled_dispatch) {
+      const uint32_t bucket_count =
+          this->spatial_grid->spatial_lookup.size() - 1;
+
+      this->compute_shader.setUnsignedInt(calc_density_tiled_kernel_id,
+                                          "kernel_id");
+      this->compute_shader.executeSyncWorkGroups(bucket_count);
+
+      this->compute_shader.setUnsignedInt(fused_step_tiled_kernel_id,
+                                          "kernel_id");
+      this->compute_shader.executeSyncWorkGroups(bucket_count);
+    } else {
+      this->compute_shader.setUnsignedInt(calc_density_kernel_id, "kernel_id");
+      this->compute_shader.executeSync(this->particle_count);
+
+      // Forces, integration, screen bounds and cell keys in one pass.
+      this->compute_shader.setUnsignedInt(fused_step_kernel_id, "kernel_id");
+      this->compute_shader.executeSync(this->particle_count);
+    }
+
+    if (this->gpu_sort_interval > 0 &&
+        ++this->steps_since_gpu_sort >= this->gpu_sort_interval) {
+      this->steps_since_gpu_sort = 0;
+      this->sortParticlesByCellGpu(cell_keys_ssbo_id, next_positions_ssbo_id,
+                                   next_velocities_ssbo_id);
+    }
+
+    if (this->gpu_stats) {
+      this->stats_reduction.reduce(next_velocities_ssbo_id, densities_ssbo_id,
+                                   this->particle_count, this->particle_mass);
+    }
+
+    this->gpu_positions_ssbo = next_positions_ssbo_id;
+    this->state_in_next_buffers = true;
+
+    // Only the new state comes back, forces and densities stay on the GPU.
+    this->compute_shader.extractVector(next_positions_ssbo_id,
+                                       this->particles.positions);
+    this->compute_shader.extractVector(next_velocities_ssbo_id,
+                                       this->particles.velocities);
+    this->compute_shader.extractVector(cell_keys_ssbo_id,
+                                       this->spatial_grid->cell_keys);
+    // The host copies now match the GPU's output buffers.
+    this->positions_dirty.clear();
+    this->velocities_dirty.clear();
+    return;
+  }
+
+  if (this->cell_tiled_dispatch) {
+    const uint32_t bucket_count = this->spatial_grid->spatial_lookup.size() - 1;
+
+    // Calculate densities
+    this->compute_shader.setUnsignedInt(calc_density_tiled_kernel_id,
+                                        "kernel_id");
+    this->compute_shader.executeSyncWorkGroups(bucket_count);
+
+    // Apply fluid forces
+    this->compute_shader.setUnsignedInt(apply_fluid_forces_tiled_kernel_id,
+                                        "kernel_id");
+    this->compute_shader.executeSyncWorkGroups(bucket_count);
+  } else {
+    // Calculate densities
+    this->compute_shader.setUnsignedInt(calc_density_kernel_id, "kernel_id");
+    this->compute_shader.executeSync(this->particle_count);
+
+    // Apply fluid forces
+    this->compute_shader.setUnsignedInt(apply_fluid_forces_kernel_id,
+                                        "kernel_id");
+    this->compute_shader.executeSync(this->particle_count);
+  }
 
   // Extract updated vectors
   this->compute_shader.extractVector(forces_ssbo_id, this->particles.forces);
   this->compute_shader.extractVector(densities_ssbo_id,
                                      this->particles.densities);
+}
 
-  for (int32_t i = 0; i < this->particle_count; i++) {
-    // std::cout << this->particles.velocities[i].x << " "
-    // << this->particles.velocities[i].y << "\n";
-    std::cout << this->particles.densities[i].x << "\n";
+void PhysicSolver::coExecuteDensitiesAndForces(const float step_dt) {
+  const std::vector<glm::vec2> &positions = this->particles.positions;
+  const float h = this->smoothing_radius;
+
+  // Split at the x below which gpu_fraction of the particles lie.
+  std::vector<float> xs(this->particle_count);
+  for (uint32_t i = 0; i < this->particle_count; i++) {
+    xs[i] = positions[i].x;
+  }
+  const uint32_t split_rank =
+      this->co_execution_gpu_fraction * this->particle_count;
+  float split_x = std::numeric_limits<float>::max();
+  if (split_rank < this->particle_count) {
+    std::nth_element(xs.begin(), xs.begin() + split_rank, xs.end());
+    split_x = xs[split_rank];
+  }
+
+  // Forces read neighbour densities up to h across the split. Each side
+  // recomputes densities over that halo from the shared positions instead of
+  // exchanging them mid step, so the two sides only meet at the end.
+  std::vector<int32_t> gpu_halo;
+  std::vector<int32_t> cpu_halo;
+  this->gpu_order.clear();
+  this->cpu_order.clear();
+  for (uint32_t i = 0; i < this->particle_count; i++) {
+    const float x = positions[i].x;
+    if (x < split_x) {
+      this->gpu_order.push_back(i);
+      if (x >= split_x - h)
+        cpu_halo.push_back(i);
+    } else {
+      this->cpu_order.push_back(i);
+      if (x < split_x + h)
+        gpu_halo.push_back(i);
+    }
+  }
+  const uint32_t gpu_owned = this->gpu_order.size();
+  const uint32_t cpu_owned = this->cpu_order.size();
+  this->gpu_order.insert(this->gpu_order.end(), gpu_halo.begin(),
+                         gpu_halo.end());
+  this->cpu_order.insert(this->cpu_order.end(), cpu_halo.begin(),
+                         cpu_halo.end());
+
+  // GPU side, dispatches return immediately.
+  this->compute_shader.use();
+  this->uploadParticleState();
+  const uint32_t forces_ssbo_id =
+      this->compute_shader.createVector<glm::vec2>(this->particle_count, 2);
+  const uint32_t densities_ssbo_id =
+      this->compute_shader.createVector<glm::vec2>(this->particle_count, 3);
+  this->compute_shader.setVector(this->gpu_order, 9);
+  // Binding 9 no longer holds dispatch_order.
+  this->uploaded_dispatch_order.clear();
+  this->compute_shader.setUnsignedInt(1, "scheduled_dispatch");
+  this->setFluidUniforms(step_dt);
+
+  const uint32_t calc_density_kernel_id = 0;
+  const uint32_t apply_fluid_forces_kernel_id = 1;
+
+  if (this->gpu_timer_query == 0) {
+    glGenQueries(1, &this->gpu_timer_query);
+  }
+  glBeginQuery(GL_TIME_ELAPSED, this->gpu_timer_query);
+  this->compute_shader.setUnsignedInt(this->gpu_order.size(), "dispatch_count");
+  this->compute_shader.setUnsignedInt(calc_density_kernel_id, "kernel_id");
+  this->compute_shader.executeSync(this->gpu_order.size());
+  this->compute_shader.setUnsignedInt(gpu_owned, "dispatch_count");
+  this->compute_shader.setUnsignedInt(apply_fluid_forces_kernel_id,
+                                      "kernel_id");
+  this->compute_shader.executeSync(gpu_owned);
+  glEndQuery(GL_TIME_ELAPSED);
+  // Make sure the GPU starts before this thread joins the CPU work.
+  glFlush();
+
+  // CPU side, overlaps with the dispatches above.
+  const auto cpu_start = std::chrono::steady_clock::now();
+  this->cpu_compute->calcDensities(this->cpu_order, this->cpu_order.size());
+  this->cpu_compute->applyFluidForces(this->cpu_order, cpu_owned);
+  this->co_execution_cpu_ms =
+      std::chrono::duration<float, std::milli>(
+          std::chrono::steady_clock::now() - cpu_start)
+          .count();
 
-    // std::cout << this->spatial_grid->spatial_lookup[i] << " ";
+  // Take the GPU's owned results, its halo belongs to the CPU.
+  this->gpu_forces.resize(this->particle_count);
+  this->gpu_densities.resize(this->particle_count);
+  this->compute_shader.extractVector(forces_ssbo_id, this->gpu_forces);
+  this->compute_shader.extractVector(densities_ssbo_id, this->gpu_densities);
+  for (uint32_t i = 0; i < gpu_owned; i++) {
+    const int32_t p_i = this->gpu_order[i];
+    this->particles.forces[p_i] = this->gpu_forces[p_i];
+    this->particles.densities[p_i] = this->gpu_densities[p_i];
   }
-  // std::cout << "\n";
+
+  uint64_t gpu_ns = 0;
+  glGetQueryObjectui64v(this->gpu_timer_query, GL_QUERY_RESULT, &gpu_ns);
+  this->co_execution_gpu_ms = gpu_ns / 1e6f;
+
+  // Move the split towards the ratio at which both sides would finish
+  // together, damped so a single noisy step does not swing it.
+  if (gpu_owned > 0 && cpu_owned > 0 && this->co_execution_gpu_ms > 0.f &&
+      this->co_execution_cpu_ms > 0.f) {
+    const float gpu_rate = gpu_owned / this->co_execution_gpu_ms;
+    const float cpu_rate = cpu_owned / this->co_execution_cpu_ms;
+    const float target_fraction = gpu_rate / (gpu_rate + cpu_rate);
+    this->co_execution_gpu_fraction +=
+        0.25f * (target_fraction - this->co_execution_gpu_fraction);
+  }
+  this->co_execution_gpu_fraction =
+      glm::clamp(this->co_execution_gpu_fraction, 0.05f, 0.95f);
 }
 
 void PhysicSolver::constrainParticlesToScreen(const float step_dt) {
+  this->positions_dirty.markAll();
+  this->velocities_dirty.markAll();
+  for (int32_t i = 0; i < this->particle_count; i++) {
+    this->constrainParticleToScreen(i);
+  }
+}
 
-  const float damp = 0.5f;
+void PhysicSolver::constrainParticleToScreen(const uint32_t p_i) {
+  glm::vec2 &pos = this->particles.positions[p_i];
+  glm::vec2 &vel = this->particles.velocities[p_i];
 
   // Right/left
-  for (int32_t i = 0; i < this->particle_count; i++) {
-    if (this->particles.positions[i].x + this->particle_radius >
-        this->world_size.x) {
-      this->particles.positions[i].x =
-          this->world_size.x - this->particle_radius;
-      this->particles.velocities[i].x *= -1 * damp;
-    } else if (this->particles.positions[i].x - this->particle_radius < 0.0f) {
-      this->particles.positions[i].x = this->particle_radius;
-      this->particles.velocities[i].x *= -1 * damp;
+  if (pos.x + this->particle_radius > this->world_size.x) {
+    pos.x = this->world_size.x - this->particle_radius;
+    vel.x *= -1 * boundary_damping;
+  } else if (pos.x - this->particle_radius < 0.0f) {
+    pos.x = this->particle_radius;
+    vel.x *= -1 * boundary_damping;
+  }
+
+  // Top/bottom
+  if (pos.y + this->particle_radius > this->world_size.y) {
+    pos.y = this->world_size.y - this->particle_radius;
+    vel.y *= -1 * boundary_damping;
+  } else if (pos.y - this->particle_radius < 0.0f) {
+    pos.y = this->particle_radius;
+    vel.y *= -1 * boundary_damping;
+  }
+}
+
+template <typename T>
+static void applyPermutation(std::vector<T> &vec,
+                             const std::vector<int32_t> &order) {
+  std::vector<T> sorted(vec.size());
+  for (uint32_t i = 0; i < order.size(); i++) {
+    sorted[i] = vec[order[i]];
+  }
+  // Copy back rather than swap, SpatialGrid holds a reference to positions.
+  std::copy(sorted.begin(), sorted.end(), vec.begin());
+}
+
+void PhysicSolver::sortParticlesByCell() {
+  // spatial_indicies lists particles grouped by bucket, so gathering every
+  // attribute in that order makes each bucket contiguous in memory.
+  std::vector<int32_t> &order = this->spatial_grid->spatial_indicies;
+
+  applyPermutation(this->particles.positions, order);
+  applyPermutation(this->particles.velocities, order);
+  applyPermutation(this->particles.forces, order);
+  applyPermutation(this->particles.densities, order);
+  applyPermutation(this->particles.species, order);
+  applyPermutation(this->particles.ids, order);
+  applyPermutation(this->spatial_grid->cell_keys, order);
+  this->positions_dirty.markAll();
+  this->velocities_dirty.markAll();
+  this->species_changed = true;
+  this->reorder_count++;
+
+  // Bucket ranges are unchanged, particles are now stored in bucket order.
+  std::iota(order.begin(), order.end(), 0);
+}
+
+void PhysicSolver::sortParticlesByCellGpu(const uint32_t cell_keys_ssbo_id,
+                                          const uint32_t positions_ssbo_id,
+                                          const uint32_t velocities_ssbo_id) {
+  const uint32_t bucket_count = this->spatial_grid->spatial_lookup.size() - 1;
+  this->radix_sort.sort(cell_keys_ssbo_id, this->particle_count,
+                        RadixSort::keyBits(bucket_count - 1));
+
+  this->radix_sort.gatherInPlace(cell_keys_ssbo_id, this->particle_count,
+                                 sizeof(int32_t));
+  this->radix_sort.gatherInPlace(positions_ssbo_id, this->particle_count,
+                                 sizeof(glm::vec2));
+  this->radix_sort.gatherInPlace(velocities_ssbo_id, this->particle_count,
+                                 sizeof(glm::vec2));
+
+  // Attributes that only live on the host follow the same permutation.
+  std::vector<int32_t> order(this->particle_count);
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+  this->compute_shader.extractVector(this->radix_sort.permutation(), order);
+  applyPermutation(this->particles.forces, order);
+  applyPermutation(this->particles.densities, order);
+  applyPermutation(this->particles.species, order);
+  applyPermutation(this->particles.ids, order);
+  this->species_changed = true;
+  this->reorder_count++;
+}
+
+uint64_t PhysicSolver::estimateNeighbourReadBytes(const bool cell_tiled) {
+  // Bytes fetched from the particle SSBOs for neighbour data by one density
+  // and one force pass. Density reads index + position, force reads index +
+  // position + velocity + density.
+  const uint64_t density_bytes = sizeof(int32_t) + sizeof(glm::vec2);
+  const uint64_t force_bytes = sizeof(int32_t) + 3 * sizeof(glm::vec2);
+
+  std::vector<int32_t> &lookup = this->spatial_grid->spatial_lookup;
+  std::vector<int32_t> &indicies = this->spatial_grid->spatial_indicies;
+
+  uint64_t neighbour_reads = 0;
+  for (int32_t bucket = 0; bucket < lookup.size() - 1; bucket++) {
+    const int32_t start = lookup[bucket];
+    const int32_t end = lookup[bucket + 1];
+    if (start == end)
+      continue;
+
+    const glm::ivec2 cell_coord = this->spatial_grid->positionToCellCoord(
+        this->particles.positions[indicies[start]]);
+    const uint64_t neighbourhood_size =
+        this->spatial_grid->neighbourhoodSize(cell_coord);
+
+    // Particle centric: every particle in the bucket fetches the whole
+    // neighbourhood. Cell tiled: the work group fetches it once.
+    neighbour_reads +=
+        cell_tiled ? neighbourhood_size : neighbourhood_size * (end - start);
+  }
+
+  return neighbour_reads * (density_bytes + force_bytes);
+}
+
+void PhysicSolver::updateNeighbourCounts() {
+  // Candidate count per particle, which is what the kernel loops over.
+  // Particles sharing a bucket usually share a cell so reuse its count.
+  std::vector<int32_t> &lookup = this->spatial_grid->spatial_lookup;
+  std::vector<int32_t> &indicies = this->spatial_grid->spatial_indicies;
+
+  for (int32_t bucket = 0; bucket < lookup.size() - 1; bucket++) {
+    glm::ivec2 prev_cell_coord;
+    int32_t prev_count = -1;
+    for (int32_t i = lookup[bucket]; i < lookup[bucket + 1]; i++) {
+      const int32_t p_i = indicies[i];
+      const glm::ivec2 cell_coord = this->spatial_grid->positionToCellCoord(
+          this->particles.positions[p_i]);
+      if (prev_count < 0 || cell_coord != prev_cell_coord) {
+        prev_cell_coord = cell_coord;
+        prev_count = this->spatial_grid->neighbourhoodSize(cell_coord);
+      }
+      this->neighbour_counts[p_i] = prev_count;
     }
+  }
+}
+
+void PhysicSolver::updateDispatchOrder() {
+  // Stable counting sort by neighbour count, so consecutive invocations (and
+  // therefore work groups) have similar loop lengths.
+  const int32_t max_count = *std::max_element(this->neighbour_counts.begin(),
+                                              this->neighbour_counts.end());
+  std::vector<int32_t> bin_starts(max_count + 2, 0);
 
-    // Top/bottom
-    if (this->particles.positions[i].y + this->particle_radius >
-        this->world_size.y) {
-      this->particles.positions[i].y =
-          this->world_size.y - this->particle_radius;
-      this->particles.velocities[i].y *= -1 * damp;
-    } else if (this->particles.positions[i].y - this->particle_radius < 0.0f) {
-      this->particles.positions[i].y = this->particle_radius;
-      this->particles.velocities[i].y *= -1 * damp;
+  for (int32_t i = 0; i < this->particle_count; i++) {
+    bin_starts[this->neighbour_counts[i] + 1]++;
+  }
+  for (int32_t i = 1; i < bin_starts.size(); i++) {
+    bin_starts[i] += bin_starts[i - 1];
+  }
+  for (int32_t i = 0; i < this->particle_count; i++) {
+    this->dispatch_order[bin_starts[this->neighbour_counts[i]]++] = i;
+  }
+}
+
+float PhysicSolver::estimateIdleLanePercentage(const bool scheduled) {
+  // Each lane of a work group runs as long as the group's densest member,
+  // count the lane iterations spent waiting on it.
+  const uint32_t lanes = 64;
+  uint64_t busy_iterations = 0;
+  uint64_t total_iterations = 0;
+
+  for (uint32_t group_start = 0; group_start < this->particle_count;
+       group_start += lanes) {
+    const uint32_t group_end =
+        std::min(group_start + lanes, this->particle_count);
+
+    int32_t group_max = 0;
+    for (uint32_t i = group_start; i < group_end; i++) {
+      const int32_t p_i = scheduled ? this->dispatch_order[i] : i;
+      busy_iterations += this->neighbour_counts[p_i];
+      group_max = std::max(group_max, this->neighbour_counts[p_i]);
     }
+    total_iterations += (uint64_t)group_max * lanes;
   }
+
+  if (total_iterations == 0)
+    return 0.f;
+  return 100.f * (total_iterations - busy_iterations) / total_iterations;
 }
@@ -1,13 +1,51 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 
 #include <glm/glm.hpp>
 
-// #include "gpu_compute.hpp"
+#ifdef USE_OPENCL
+#include "gpu_compute.hpp"
+#endif
+#include "cpu_compute.hpp"
 #include "particles.hpp"
 #include "spatial_grid.hpp"
+#include "surface_extractor.hpp"
+#include "triple_buffer.hpp"
 #include "../renderer/compute_shader.hpp"
+#include "../renderer/radix_sort.hpp"
+#include "../renderer/stats_reduction.hpp"
+
+// What the renderer needs from one update, handed between threads.
+struct ParticleSnapshot {
+  std::vector<glm::vec2> positions;
+  std::vector<uint8_t> species;
+  uint64_t update_count = 0;
+  // Steady clock seconds, for interpolating between snapshots.
+  double publish_time = 0.0;
+  // Snapshots with different counts store particles in different orders.
+  uint64_t reorder_count = 0;
+};
+
+// Elements [begin, end) of a host array differ from its GPU copy.
+struct DirtyRange {
+  uint32_t begin = 0;
+  uint32_t end = UINT32_MAX;
+
+  void markAll() {
+    this->begin = 0;
+    this->end = UINT32_MAX;
+  }
+  void mark(const uint32_t first, const uint32_t last) {
+    this->begin = std::min(this->begin, first);
+    this->end = std::max(this->end, last);
+  }
+  void clear() {
+    this->begin = UINT32_MAX;
+    this->end = 0;
+  }
+};
 
 struct PhysicSolver {
   Particles particles;
@@ -19,6 +57,83 @@ struct PhysicSolver {
   float smoothing_radius;
   SpatialGrid *spatial_grid;
   ComputeShader compute_shader;
+  // Evaluate neighbours per cell through a shared memory tile instead of per
+  // particle from global memory. Sorts particles by cell every sub-step.
+  bool cell_tiled_dispatch = false;
+  // Compute forces, integrate, constrain and key cells in a single GPU
+  // kernel. Otherwise forces are read back and integrated on the host.
+  bool fused_gpu_step = true;
+  // Dispatch particles ordered by neighbour count so each work group gets a
+  // uniform load. Only applies to the particle centric kernels.
+  bool neighbour_count_scheduling = false;
+  std::vector<int32_t> neighbour_counts;
+  std::vector<int32_t> dispatch_order;
+  // Reorder the GPU particle state by cell key every n fused steps (0 = off).
+  RadixSort radix_sort;
+  uint32_t gpu_sort_interval = 0;
+  uint32_t steps_since_gpu_sort = 0;
+  // Reduce max speed, mean density and kinetic energy on the GPU after each
+  // fused step, stats is refreshed whenever an async readback completes.
+  bool gpu_stats = false;
+  StatsReduction stats_reduction;
+  SimStats stats = {};
+  // Split densities and forces between GL compute and CPU threads. The GPU
+  // owns the particles left of a vertical split holding
+  // co_execution_gpu_fraction of them, rebalanced every step from the
+  // measured time of each side. Integration stays on the host.
+  bool co_execution = false;
+  CpuCompute *cpu_compute;
+  float co_execution_gpu_fraction = 0.5f;
+  float co_execution_gpu_ms = 0.f;
+  float co_execution_cpu_ms = 0.f;
+  // Owned particles followed by the halo whose densities the owned forces
+  // read.
+  std::vector<int32_t> gpu_order;
+  std::vector<int32_t> cpu_order;
+  std::vector<glm::vec2> gpu_forces;
+  std::vector<glm::vec2> gpu_densities;
+  uint32_t gpu_timer_query = 0;
+  // Host arrays whose GPU copy is stale. Each sub-step only uploads these
+  // ranges, anything writing the arrays outside update() must mark them.
+  DirtyRange positions_dirty;
+  DirtyRange velocities_dirty;
+  DirtyRange lookup_dirty;
+  DirtyRange indicies_dirty;
+  DirtyRange dispatch_order_dirty;
+  // Last uploaded copies, diffed against the rebuilt arrays each sub-step.
+  std::vector<int32_t> uploaded_lookup;
+  std::vector<int32_t> uploaded_indicies;
+  std::vector<int32_t> uploaded_dispatch_order;
+  // The fused step left the newest positions and velocities in its output
+  // buffers, so the next sub-step copies them over on the GPU.
+  bool state_in_next_buffers = false;
+  // Bus traffic of the last update.
+  uint64_t update_uploaded_bytes = 0;
+  uint64_t update_read_back_bytes = 0;
+  // SSBO holding the newest positions when the last update left them on the
+  // GPU (fused GL step), 0 otherwise. Lets the renderer draw without a copy.
+  uint32_t gpu_positions_ssbo = 0;
+  // Set whenever species are reordered, cleared by whoever re-uploads them.
+  bool species_changed = true;
+  // Bumped every time the particle arrays are permuted.
+  uint64_t reorder_count = 0;
+  // Extract the free surface as line segments after every update, only
+  // redoing the parts of the domain particles moved through.
+  bool surface_extraction = false;
+  SurfaceExtractor *surface_extractor;
+  // Publish a snapshot after every update, for a renderer on another
+  // thread. The renderer must then only read snapshots, never the solver.
+  bool publish_snapshots = false;
+  TripleBuffer<ParticleSnapshot> snapshots;
+  uint64_t update_count = 0;
+  // Random per run, kept by a restore. Checkpoints of the same run are
+  // ordered by update_count, those of other runs are simply replaced.
+  uint64_t run_id;
+#ifdef USE_OPENCL
+  // OpenCL backend, runs the whole step on the device when set.
+  GpuCompute *gpu_compute = nullptr;
+  GpuComputeOptions opencl_options;
+#endif
 
   PhysicSolver(glm::vec2 _screen_size, const uint32_t _particle_count,
                const float _particle_radius, const float _particle_mass,
@@ -28,11 +143,48 @@ struct PhysicSolver {
 
   void update(const float dt);
 
+  void publishSnapshot();
+
+#ifdef USE_OPENCL
+  void useOpenCl(const std::string &kernel_path);
+#endif
+
   void applyGravity(float step_dt);
 
   void calcDensities(const float step_dt);
 
+  void setFluidUniforms(const float step_dt);
+
+  void uploadParticleState();
+
+  template <typename T>
+  void uploadDirty(std::vector<T> &vec, DirtyRange &range,
+                   const uint32_t binding_id);
+
+  void markChanges(const std::vector<int32_t> &current,
+                   std::vector<int32_t> &uploaded, DirtyRange &range);
+
   void calcDensitiesAndApplyPressureForce(const float step_dt);
 
+  void coExecuteDensitiesAndForces(const float step_dt);
+
+  void integrateAndConstrain(const float step_dt);
+
   void constrainParticlesToScreen(const float step_dt);
+
+  void constrainParticleToScreen(const uint32_t p_i);
+
+  void sortParticlesByCell();
+
+  void sortParticlesByCellGpu(const uint32_t cell_keys_ssbo_id,
+                              const uint32_t positions_ssbo_id,
+                              const uint32_t velocities_ssbo_id);
+
+  uint64_t estimateNeighbourReadBytes(const bool cell_tiled);
+
+  void updateNeighbourCounts();
+
+  void updateDispatchOrder();
+
+  float estimateIdleLanePercentage(const bool scheduled);
 };
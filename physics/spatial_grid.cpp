@@ -5,22 +5,33 @@
 
 SpatialGrid::SpatialGrid(std::vector<glm::vec2> &_positions,
                          const float smoothing_radius)
-    : spatial_lookup(_positions.size() + 1),
-      spatial_indicies(_positions.size()), cell_width(2 * smoothing_radius),
-      positions(_positions){};
+    : cell_width(2 * smoothing_radius), positions(_positions),
+      spatial_lookup(_positions.size() + 1),
+      spatial_indicies(_positions.size()), cell_keys(_positions.size()){};
 
 void SpatialGrid::update() {
+  this->updateCellKeys();
+  this->updateFromCellKeys();
+}
+
+void SpatialGrid::updateCellKeys() { this->updateCellKeys(this->positions); }
+
+void SpatialGrid::updateCellKeys(const std::vector<glm::vec2> &_positions) {
+  for (int32_t i = 0; i < _positions.size(); i++) {
+    glm::ivec2 cell_coord = this->positionToCellCoord(_positions[i]);
+    this->cell_keys[i] = this->cellCoordToHash(cell_coord);
+  }
+}
+
+void SpatialGrid::updateFromCellKeys() {
   // Reset counts to zero.
   std::fill(this->spatial_lookup.begin(), this->spatial_lookup.end(), 0);
 
   // Find bucket counts
-  for (int32_t i = 0; i < this->positions.size(); i++) {
-    glm::ivec2 cell_coord = this->positionToCellCoord(this->positions[i]);
-    int32_t cell_hash = this->cellCoordToHash(cell_coord);
-
+  for (int32_t i = 0; i < this->cell_keys.size(); i++) {
     // #Buckets = #Particles with one extra for dealing with overflow
     // Contains start and end indicies for each group.
-    this->spatial_lookup[cell_hash]++;
+    this->spatial_lookup[this->cell_keys[i]]++;
   }
 
   // Cumulative sum
@@ -29,9 +40,8 @@ void SpatialGrid::update() {
   }
 
   // Fill spatial indicies
-  for (int32_t i = 0; i < this->positions.size(); i++) {
-    glm::ivec2 cell_coord = this->positionToCellCoord(this->positions[i]);
-    int32_t cell_hash = this->cellCoordToHash(cell_coord);
+  for (int32_t i = 0; i < this->cell_keys.size(); i++) {
+    int32_t cell_hash = this->cell_keys[i];
 
     this->spatial_lookup[cell_hash]--;
     this->spatial_indicies[this->spatial_lookup[cell_hash]] = i;
@@ -52,3 +62,15 @@ int32_t SpatialGrid::cellCoordToHash(glm::ivec2 cell_coord) {
 
   return hash;
 }
+
+int32_t SpatialGrid::neighbourhoodSize(glm::ivec2 cell_coord) {
+  // Number of candidates a neighbour query over the 3x3 cells walks through.
+  int32_t size = 0;
+  for (int32_t y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
+    for (int32_t x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
+      const int32_t hash = this->cellCoordToHash(glm::ivec2(x, y));
+      size += this->spatial_lookup[hash + 1] - this->spatial_lookup[hash];
+    }
+  }
+  return size;
+}
@@ -9,12 +9,23 @@ struct SpatialGrid {
   std::vector<glm::vec2> &positions;
   std::vector<int32_t> spatial_lookup;
   std::vector<int32_t> spatial_indicies;
+  // Bucket of each particle, written by the integrator as it moves particles.
+  std::vector<int32_t> cell_keys;
 
   SpatialGrid(std::vector<glm::vec2> &_positions, const float smoothing_radius);
 
   void update();
 
+  void updateCellKeys();
+
+  // Key from another array of the same size, e.g. a snapshot being drawn.
+  void updateCellKeys(const std::vector<glm::vec2> &_positions);
+
+  void updateFromCellKeys();
+
   glm::ivec2 positionToCellCoord(glm::vec2 pos);
 
   int32_t cellCoordToHash(glm::ivec2 key);
+
+  int32_t neighbourhoodSize(glm::ivec2 cell_coord);
 };
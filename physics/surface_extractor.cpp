@@ -0,0 +1,227 @@
+#include "surface_extractor.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <glm/geometric.hpp>
+
+namespace {
+
+const float pi = 3.14159265f;
+
+// Edges crossed per marching squares case, as pairs. Corners 0-3 run
+// counter clockwise from the bottom left, edge i joins corner i and i + 1.
+// The saddles 5 and 10 are resolved in marchBlock.
+const int8_t case_edges[16][4] = {
+    {-1, -1, -1, -1}, {3, 0, -1, -1}, {0, 1, -1, -1}, {3, 1, -1, -1},
+    {1, 2, -1, -1},   {-1, -1, -1, -1}, {0, 2, -1, -1}, {3, 2, -1, -1},
+    {3, 2, -1, -1},   {0, 2, -1, -1}, {-1, -1, -1, -1}, {1, 2, -1, -1},
+    {3, 1, -1, -1},   {0, 1, -1, -1}, {3, 0, -1, -1},   {-1, -1, -1, -1}};
+
+} // namespace
+
+SurfaceExtractor::SurfaceExtractor(const glm::vec2 _world_size,
+                                   const float _spacing, const float _h,
+                                   const float _particle_mass,
+                                   const float _iso_density)
+    : world_size(_world_size), spacing(_spacing), h(_h),
+      particle_mass(_particle_mass), iso_density(_iso_density),
+      move_tolerance(0.05f * _spacing) {
+  this->thread_count = std::max(1u, std::thread::hardware_concurrency());
+  this->node_count = glm::ivec2(glm::ceil(_world_size / _spacing)) + 1;
+  this->block_count = (this->node_count + block_size - 1) / block_size;
+  this->field.resize(this->node_count.x * this->node_count.y, 0.f);
+  this->dirty_blocks.resize(this->block_count.x * this->block_count.y, 1);
+  this->block_segments.resize(this->dirty_blocks.size());
+}
+
+template <typename F>
+void SurfaceExtractor::parallelFor(const uint32_t count, F func) {
+  // Blocks near the surface cost more, so hand them out one at a time.
+  std::atomic<uint32_t> next(0);
+  std::vector<std::thread> threads;
+  const uint32_t used_threads = std::min(this->thread_count, count);
+  for (uint32_t t = 0; t < used_threads; t++) {
+    threads.emplace_back([count, &next, &func]() {
+      for (uint32_t i = next++; i < count; i = next++) {
+        func(i);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+void SurfaceExtractor::extract(const std::vector<glm::vec2> &positions,
+                               SpatialGrid *spatial_grid,
+                               const uint64_t reorder_count) {
+  if (!this->extracted || reorder_count != this->last_reorder_count ||
+      this->last_positions.size() != positions.size()) {
+    std::fill(this->dirty_blocks.begin(), this->dirty_blocks.end(), 1);
+    this->last_positions = positions;
+    this->last_reorder_count = reorder_count;
+    this->extracted = true;
+  } else {
+    // Both where a particle's kernel was and where it is now changed.
+    for (uint32_t i = 0; i < positions.size(); i++) {
+      if (glm::distance(positions[i], this->last_positions[i]) >
+          this->move_tolerance) {
+        this->markDirty(this->last_positions[i]);
+        this->markDirty(positions[i]);
+        this->last_positions[i] = positions[i];
+      }
+    }
+  }
+
+  std::vector<int32_t> dirty;
+  for (int32_t b = 0; b < this->dirty_blocks.size(); b++) {
+    if (this->dirty_blocks[b]) {
+      dirty.push_back(b);
+    }
+  }
+  this->dirty_block_total = dirty.size();
+
+  // Blocks own disjoint nodes, so sampling needs no synchronisation.
+  this->parallelFor(dirty.size(), [&](uint32_t i) {
+    const glm::ivec2 block(dirty[i] % this->block_count.x,
+                           dirty[i] / this->block_count.x);
+    const glm::ivec2 lo = block * block_size;
+    const glm::ivec2 hi = glm::min(lo + block_size, this->node_count);
+    for (int32_t y = lo.y; y < hi.y; y++) {
+      for (int32_t x = lo.x; x < hi.x; x++) {
+        this->field[y * this->node_count.x + x] = this->sampleDensity(
+            glm::vec2(x, y) * this->spacing, positions, spatial_grid);
+      }
+    }
+  });
+  // Squares read nodes of neighbouring blocks, so only after every sample.
+  this->parallelFor(dirty.size(),
+                    [&](uint32_t i) { this->marchBlock(dirty[i]); });
+
+  std::fill(this->dirty_blocks.begin(), this->dirty_blocks.end(), 0);
+  this->segment_total = 0;
+  for (const std::vector<SurfaceSegment> &segments : this->block_segments) {
+    this->segment_total += segments.size();
+  }
+}
+
+float SurfaceExtractor::latticeDensity(const float lattice_spacing,
+                                       const float _h,
+                                       const float _particle_mass) {
+  const int32_t reach = (int32_t)(_h / lattice_spacing);
+  const float poly6 = 4.f / (pi * glm::pow(_h, 8.f));
+  float density = 0.f;
+  for (int32_t y = -reach; y <= reach; y++) {
+    for (int32_t x = -reach; x <= reach; x++) {
+      const float r2 = (x * x + y * y) * lattice_spacing * lattice_spacing;
+      if (r2 < _h * _h) {
+        density += _particle_mass * poly6 * glm::pow(_h * _h - r2, 3.f);
+      }
+    }
+  }
+  return density;
+}
+
+void SurfaceExtractor::markDirty(const glm::vec2 pos) {
+  // Nodes within the kernel, and the squares below and left of them that
+  // share those nodes.
+  const glm::ivec2 lo = glm::ivec2(glm::floor((pos - this->h) / this->spacing)) - 1;
+  const glm::ivec2 hi = glm::ivec2(glm::ceil((pos + this->h) / this->spacing));
+  const glm::ivec2 block_lo =
+      glm::clamp(lo / block_size, glm::ivec2(0), this->block_count - 1);
+  const glm::ivec2 block_hi =
+      glm::clamp(hi / block_size, glm::ivec2(0), this->block_count - 1);
+  for (int32_t y = block_lo.y; y <= block_hi.y; y++) {
+    for (int32_t x = block_lo.x; x <= block_hi.x; x++) {
+      this->dirty_blocks[y * this->block_count.x + x] = 1;
+    }
+  }
+}
+
+float SurfaceExtractor::sampleDensity(const glm::vec2 pos,
+                                      const std::vector<glm::vec2> &positions,
+                                      SpatialGrid *spatial_grid) {
+  // Same poly6 sum as CpuCompute::calcDensity, at a point in space.
+  const std::vector<int32_t> &lookup = spatial_grid->spatial_lookup;
+  const std::vector<int32_t> &indicies = spatial_grid->spatial_indicies;
+  const glm::ivec2 cell_coord = spatial_grid->positionToCellCoord(pos);
+  const float poly6 = 4.f / (pi * glm::pow(this->h, 8.f));
+  const float h2 = this->h * this->h;
+
+  float density = 0.f;
+  for (int32_t y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
+    for (int32_t x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
+      const int32_t hash = spatial_grid->cellCoordToHash({x, y});
+      for (int32_t i = lookup[hash]; i < lookup[hash + 1]; i++) {
+        const glm::vec2 offset = pos - positions[indicies[i]];
+        const float r2 = glm::dot(offset, offset);
+        if (r2 < h2) {
+          const float w = h2 - r2;
+          density += w * w * w;
+        }
+      }
+    }
+  }
+  return this->particle_mass * poly6 * density;
+}
+
+void SurfaceExtractor::marchBlock(const int32_t block) {
+  std::vector<SurfaceSegment> &segments = this->block_segments[block];
+  segments.clear();
+
+  const glm::ivec2 block_coord(block % this->block_count.x,
+                               block / this->block_count.x);
+  const glm::ivec2 lo = block_coord * block_size;
+  // The last row and column of nodes start no square.
+  const glm::ivec2 hi = glm::min(lo + block_size, this->node_count - 1);
+  const float iso = this->iso_density;
+
+  for (int32_t y = lo.y; y < hi.y; y++) {
+    for (int32_t x = lo.x; x < hi.x; x++) {
+      const glm::ivec2 corners[4] = {{x, y}, {x + 1, y}, {x + 1, y + 1},
+                                     {x, y + 1}};
+      float values[4];
+      uint32_t square_case = 0;
+      for (int32_t c = 0; c < 4; c++) {
+        values[c] = this->field[corners[c].y * this->node_count.x + corners[c].x];
+        square_case |= (values[c] > iso) << c;
+      }
+
+      auto edgePoint = [&](const int32_t edge) {
+        const int32_t c0 = edge;
+        const int32_t c1 = (edge + 1) % 4;
+        const float t = (iso - values[c0]) / (values[c1] - values[c0]);
+        return glm::mix(glm::vec2(corners[c0]), glm::vec2(corners[c1]), t) *
+               this->spacing;
+      };
+
+      int8_t edges[4];
+      std::copy(case_edges[square_case], case_edges[square_case] + 4, edges);
+      if (square_case == 5 || square_case == 10) {
+        // Saddle: the centre decides whether the inside corners connect.
+        const bool centre_inside =
+            0.25f * (values[0] + values[1] + values[2] + values[3]) > iso;
+        const bool cut_even_corners = (square_case == 5) != centre_inside;
+        const int8_t even[4] = {3, 0, 1, 2};
+        const int8_t odd[4] = {0, 1, 2, 3};
+        std::copy(cut_even_corners ? even : odd,
+                  (cut_even_corners ? even : odd) + 4, edges);
+      }
+
+      for (int32_t e = 0; e < 4 && edges[e] >= 0; e += 2) {
+        segments.push_back({edgePoint(edges[e]), edgePoint(edges[e + 1])});
+      }
+    }
+  }
+}
+
+std::vector<SurfaceSegment> SurfaceExtractor::segments() const {
+  std::vector<SurfaceSegment> all;
+  all.reserve(this->segment_total);
+  for (const std::vector<SurfaceSegment> &segments : this->block_segments) {
+    all.insert(all.end(), segments.begin(), segments.end());
+  }
+  return all;
+}
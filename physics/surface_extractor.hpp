@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "spatial_grid.hpp"
+
+struct SurfaceSegment {
+  glm::vec2 a;
+  glm::vec2 b;
+};
+
+// Free surface as line segments: SPH density sampled on a regular grid of
+// nodes, then marching squares at iso_density. Nodes and squares are
+// grouped into blocks, and only blocks within reach of particles that
+// moved since the last extraction are resampled and re-marched.
+struct SurfaceExtractor {
+  static const int32_t block_size = 16;
+
+  glm::vec2 world_size;
+  float spacing;
+  float h;
+  float particle_mass;
+  float iso_density;
+  // Particles that moved less than this since the last extraction don't
+  // dirty anything, so a fluid at rest costs almost nothing.
+  float move_tolerance;
+  uint32_t thread_count;
+
+  glm::ivec2 node_count;
+  glm::ivec2 block_count;
+  std::vector<float> field;
+  std::vector<uint8_t> dirty_blocks;
+  // Marched segments per block, rewritten only when the block is dirty.
+  std::vector<std::vector<SurfaceSegment>> block_segments;
+  std::vector<glm::vec2> last_positions;
+  uint64_t last_reorder_count = 0;
+  bool extracted = false;
+
+  uint32_t dirty_block_total = 0;
+  uint32_t segment_total = 0;
+
+  SurfaceExtractor(const glm::vec2 _world_size, const float _spacing,
+                   const float _h, const float _particle_mass,
+                   const float _iso_density);
+
+  // The grid's lookup must match positions. A different reorder_count than
+  // last time means indices changed meaning, so everything is redone.
+  void extract(const std::vector<glm::vec2> &positions,
+               SpatialGrid *spatial_grid, const uint64_t reorder_count);
+
+  // Density inside a square lattice of particles, a scale for iso_density.
+  static float latticeDensity(const float lattice_spacing, const float _h,
+                              const float _particle_mass);
+
+  void markDirty(const glm::vec2 pos);
+
+  float sampleDensity(const glm::vec2 pos,
+                      const std::vector<glm::vec2> &positions,
+                      SpatialGrid *spatial_grid);
+
+  void marchBlock(const int32_t block);
+
+  // Every segment, block by block.
+  std::vector<SurfaceSegment> segments() const;
+
+  template <typename F> void parallelFor(const uint32_t count, F func);
+};
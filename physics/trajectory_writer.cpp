@@ -0,0 +1,175 @@
+#include "trajectory_writer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+const char trajectory_magic[8] = {'S', 'P', 'H', 'T', 'R', 'A', 'J', '\0'};
+const uint32_t trajectory_byte_order = 0x01020304;
+
+} // namespace
+
+TrajectoryWriter::TrajectoryWriter(const std::string &_path,
+                                   const uint32_t _particle_count,
+                                   const uint32_t queue_capacity,
+                                   const uint32_t _cadence,
+                                   const TrajectoryBackpressure _backpressure,
+                                   const size_t _chunk_bytes)
+    : path(_path), particle_count(_particle_count),
+      cadence(std::max(1u, _cadence)), backpressure(_backpressure),
+      chunk_bytes(_chunk_bytes), frames(std::max(1u, queue_capacity)),
+      queued(std::max(1u, queue_capacity)),
+      recycled(std::max(1u, queue_capacity)) {
+  this->file = fopen(this->path.c_str(), "wb");
+  if (this->file == nullptr) {
+    std::cerr << "Failed to open trajectory: " << this->path << "\n";
+    return;
+  }
+  // Chunks are already large, stdio buffering would only add a copy.
+  setvbuf(this->file, nullptr, _IONBF, 0);
+  this->chunk.reserve(this->chunk_bytes);
+
+  // Every buffer is allocated once here and then only cycles between the
+  // two queues.
+  for (TrajectoryFrame &frame : this->frames) {
+    frame.ids.resize(this->particle_count);
+    frame.positions.resize(this->particle_count);
+    frame.velocities.resize(this->particle_count);
+    this->recycled.push(&frame);
+  }
+
+  TrajectoryHeader header = {};
+  std::memcpy(header.magic, trajectory_magic, sizeof(header.magic));
+  header.version = version;
+  header.byte_order = trajectory_byte_order;
+  header.particle_count = this->particle_count;
+  header.cadence = this->cadence;
+  this->append(&header, sizeof(header));
+
+  this->running = true;
+  this->writer = std::thread(&TrajectoryWriter::writeFrames, this);
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+  if (this->file == nullptr) {
+    return;
+  }
+  this->running = false;
+  this->writer.join();
+  fclose(this->file);
+  std::cout << "Wrote " << this->frames_written << " trajectory frames to "
+            << this->path << " (" << this->frames_dropped << " dropped, "
+            << this->writeBandwidth() << " MB/s)\n";
+}
+
+bool TrajectoryWriter::record(const PhysicSolver &solver) {
+  if (this->file == nullptr ||
+      solver.update_count % (this->cadence * this->decimation) != 0) {
+    return false;
+  }
+
+  TrajectoryFrame *frame = this->recycled.pop();
+  if (frame == nullptr && this->backpressure == trajectory_block) {
+    const auto wait_start = std::chrono::steady_clock::now();
+    while ((frame = this->recycled.pop()) == nullptr) {
+      std::this_thread::yield();
+    }
+    this->blocked_ms += std::chrono::duration<float, std::milli>(
+                            std::chrono::steady_clock::now() - wait_start)
+                            .count();
+  }
+  if (frame == nullptr) {
+    this->frames_dropped++;
+    if (this->backpressure == trajectory_decimate) {
+      this->decimation = std::min(this->decimation * 2, max_decimation);
+    }
+    return false;
+  }
+
+  frame->update_count = solver.update_count;
+  std::copy(solver.particles.ids.begin(),
+            solver.particles.ids.begin() + this->particle_count,
+            frame->ids.begin());
+  std::copy(solver.particles.positions.begin(),
+            solver.particles.positions.begin() + this->particle_count,
+            frame->positions.begin());
+  std::copy(solver.particles.velocities.begin(),
+            solver.particles.velocities.begin() + this->particle_count,
+            frame->velocities.begin());
+  // Never fails, there are only as many frames as slots.
+  this->queued.push(frame);
+  this->frames_recorded++;
+
+  const uint32_t depth = this->queued.size();
+  this->max_queue_depth = std::max(this->max_queue_depth, depth);
+  // Back to the full rate once the writer has caught up.
+  if (this->decimation > 1 && depth <= this->frames.size() / 4) {
+    this->decimation /= 2;
+  }
+  return true;
+}
+
+float TrajectoryWriter::writeBandwidth() const {
+  const uint64_t nanoseconds = this->write_nanoseconds;
+  if (nanoseconds == 0) {
+    return 0.f;
+  }
+  return (this->bytes_written / (1024.f * 1024.f)) / (nanoseconds * 1e-9f);
+}
+
+void TrajectoryWriter::writeFrames() {
+  while (true) {
+    // Read running first, so frames queued before the stop still get out.
+    const bool stopping = !this->running;
+    TrajectoryFrame *frame = this->queued.pop();
+    if (frame == nullptr) {
+      if (stopping) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+      continue;
+    }
+
+    this->append(&frame->update_count, sizeof(frame->update_count));
+    this->append(frame->ids.data(), sizeof(uint32_t) * frame->ids.size());
+    this->append(frame->positions.data(),
+                 sizeof(glm::vec2) * frame->positions.size());
+    this->append(frame->velocities.data(),
+                 sizeof(glm::vec2) * frame->velocities.size());
+    this->recycled.push(frame);
+    this->frames_written++;
+  }
+  this->flushChunk();
+}
+
+void TrajectoryWriter::append(const void *data, const size_t bytes) {
+  if (this->chunk.size() + bytes > this->chunk_bytes) {
+    this->flushChunk();
+  }
+  const uint8_t *begin = (const uint8_t *)data;
+  this->chunk.insert(this->chunk.end(), begin, begin + bytes);
+  // Frames bigger than a chunk go out on their own.
+  if (this->chunk.size() >= this->chunk_bytes) {
+    this->flushChunk();
+  }
+}
+
+void TrajectoryWriter::flushChunk() {
+  if (this->chunk.empty()) {
+    return;
+  }
+  const auto write_start = std::chrono::steady_clock::now();
+  if (fwrite(this->chunk.data(), 1, this->chunk.size(), this->file) !=
+      this->chunk.size()) {
+    std::cerr << "Failed to write trajectory: " << this->path << "\n";
+  }
+  this->write_nanoseconds +=
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - write_start)
+          .count();
+  this->bytes_written += this->chunk.size();
+  this->chunk.clear();
+}
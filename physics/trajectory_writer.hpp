@@ -0,0 +1,141 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "physics.hpp"
+
+// Bounded ring of pointers between exactly one producer and one consumer.
+// Neither side ever blocks or locks, each only writes its own index.
+template <typename T> struct SpscQueue {
+  std::vector<T *> slots;
+  // Next slot to pop, written by the consumer.
+  alignas(64) std::atomic<uint32_t> head{0};
+  // Next slot to push, written by the producer.
+  alignas(64) std::atomic<uint32_t> tail{0};
+
+  // One slot stays empty to tell full from empty.
+  explicit SpscQueue(const uint32_t capacity) : slots(capacity + 1) {}
+
+  bool push(T *item) {
+    const uint32_t t = this->tail.load(std::memory_order_relaxed);
+    const uint32_t next = (t + 1) % this->slots.size();
+    if (next == this->head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    this->slots[t] = item;
+    this->tail.store(next, std::memory_order_release);
+    return true;
+  }
+
+  T *pop() {
+    const uint32_t h = this->head.load(std::memory_order_relaxed);
+    if (h == this->tail.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    T *item = this->slots[h];
+    this->head.store((h + 1) % this->slots.size(), std::memory_order_release);
+    return item;
+  }
+
+  // Exact only on the consumer or producer thread, a hint elsewhere.
+  uint32_t size() const {
+    const uint32_t n = this->slots.size();
+    return (this->tail.load(std::memory_order_acquire) + n -
+            this->head.load(std::memory_order_acquire)) %
+           n;
+  }
+};
+
+// What record() does when every frame buffer is still queued for writing.
+enum TrajectoryBackpressure : uint32_t {
+  // Skip this frame.
+  trajectory_drop = 0,
+  // Wait for the writer, the solver runs at disk speed.
+  trajectory_block = 1,
+  // Skip this frame and halve the recording rate until the queue drains.
+  trajectory_decimate = 2,
+};
+
+// Native endian like checkpoints, followed by one record per frame: the
+// update count, then ids, positions and velocities of every particle.
+// Sorting by cell permutes particles between frames, so analysis must
+// match them up by id, not by index. Dropped and decimated frames show up
+// as gaps in the update counts.
+struct TrajectoryHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t particle_count;
+  uint32_t cadence;
+};
+
+struct TrajectoryFrame {
+  uint64_t update_count;
+  std::vector<uint32_t> ids;
+  std::vector<glm::vec2> positions;
+  std::vector<glm::vec2> velocities;
+};
+
+// Per update particle output for analysis, written on its own thread.
+// record() copies into a recycled frame buffer and queues it, the writer
+// packs frames into large chunks so the disk sees big sequential writes.
+struct TrajectoryWriter {
+  static const uint32_t version = 2;
+  static constexpr uint32_t max_decimation = 64;
+
+  std::string path;
+  uint32_t particle_count;
+  // Record every cadence-th update.
+  uint32_t cadence;
+  TrajectoryBackpressure backpressure;
+  size_t chunk_bytes;
+
+  FILE *file = nullptr;
+  std::vector<TrajectoryFrame> frames;
+  // Filled frames towards the writer, and emptied ones back to record().
+  SpscQueue<TrajectoryFrame> queued;
+  SpscQueue<TrajectoryFrame> recycled;
+  std::vector<uint8_t> chunk;
+  std::thread writer;
+  std::atomic<bool> running{false};
+
+  // Metrics. The atomics are written by the writer thread, the rest by the
+  // solver's thread.
+  std::atomic<uint64_t> frames_written{0};
+  std::atomic<uint64_t> bytes_written{0};
+  std::atomic<uint64_t> write_nanoseconds{0};
+  uint64_t frames_recorded = 0;
+  uint64_t frames_dropped = 0;
+  uint32_t decimation = 1;
+  uint32_t max_queue_depth = 0;
+  float blocked_ms = 0.f;
+
+  TrajectoryWriter(const std::string &_path, const uint32_t _particle_count,
+                   const uint32_t queue_capacity = 8,
+                   const uint32_t _cadence = 1,
+                   const TrajectoryBackpressure _backpressure = trajectory_drop,
+                   const size_t _chunk_bytes = 8 << 20);
+  TrajectoryWriter(const TrajectoryWriter &) = delete;
+  TrajectoryWriter &operator=(const TrajectoryWriter &) = delete;
+  // Writes out everything still queued.
+  ~TrajectoryWriter();
+
+  // Call between updates on the solver's thread. False when the frame was
+  // not due, dropped or the file couldn't be opened.
+  bool record(const PhysicSolver &solver);
+
+  // Frames waiting for the writer.
+  uint32_t queueDepth() const { return this->queued.size(); }
+  // MB/s while inside write calls, what the disk sustains.
+  float writeBandwidth() const;
+
+  void writeFrames();
+  void append(const void *data, const size_t bytes);
+  void flushChunk();
+};
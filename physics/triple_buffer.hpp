@@ -0,0 +1,48 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Lock free single producer, single consumer triple buffer. The producer
+// always has a buffer to write and the consumer always has a complete one
+// to read, publishing and consuming only swap indices. Intermediate
+// publishes the consumer never saw are dropped.
+template <typename T> class TripleBuffer {
+public:
+  // Producer side.
+  T &writeBuffer() { return this->buffers[this->back]; }
+
+  void publish() {
+    const uint8_t prev = this->middle.exchange(this->back | fresh_bit,
+                                               std::memory_order_acq_rel);
+    this->back = prev & index_mask;
+  }
+
+  // Consumer side. Swaps in the newest published buffer, returns false if
+  // nothing was published since the last call.
+  bool consume() {
+    if ((this->middle.load(std::memory_order_relaxed) & fresh_bit) == 0)
+      return false;
+    const uint8_t prev =
+        this->middle.exchange(this->front, std::memory_order_acq_rel);
+    this->front = prev & index_mask;
+    return true;
+  }
+
+  // True if consume() would swap in a new buffer.
+  bool fresh() const {
+    return (this->middle.load(std::memory_order_acquire) & fresh_bit) != 0;
+  }
+
+  const T &readBuffer() const { return this->buffers[this->front]; }
+
+private:
+  static const uint8_t index_mask = 3;
+  static const uint8_t fresh_bit = 4;
+
+  T buffers[3];
+  uint8_t back = 0;
+  // Index of the buffer in between, plus fresh_bit if the consumer has not
+  // taken it yet.
+  std::atomic<uint8_t> middle{1};
+  uint8_t front = 2;
+};
@@ -0,0 +1,53 @@
+#pragma once
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+// 2D orthographic view over the world. At zoom 1 the whole world fills the
+// viewport, as the fixed projection did before.
+struct Camera {
+  glm::vec2 world_size;
+  glm::vec2 centre;
+  float zoom = 1.f;
+  float min_zoom = 0.05f;
+  float max_zoom = 200.f;
+
+  Camera(const glm::vec2 _world_size)
+      : world_size(_world_size), centre(_world_size * 0.5f) {}
+
+  glm::vec2 halfExtent() const { return this->world_size * 0.5f / this->zoom; }
+
+  glm::vec2 visibleMin() const { return this->centre - this->halfExtent(); }
+
+  glm::vec2 visibleMax() const { return this->centre + this->halfExtent(); }
+
+  glm::mat4 projection() const {
+    const glm::vec2 min = this->visibleMin();
+    const glm::vec2 max = this->visibleMax();
+    return glm::ortho(min.x, max.x, min.y, max.y, 0.f, 1.0f);
+  }
+
+  // World units per framebuffer pixel along x.
+  float worldPerPixel(const float viewport_width) const {
+    return 2.f * this->halfExtent().x / viewport_width;
+  }
+
+  // uv is 0 to 1 across the viewport, y up.
+  glm::vec2 viewportToWorld(const glm::vec2 uv) const {
+    return glm::mix(this->visibleMin(), this->visibleMax(), uv);
+  }
+
+  void pan(const glm::vec2 delta) { this->centre += delta; }
+
+  // Scale by factor while keeping the world point under uv fixed.
+  void zoomAt(const float factor, const glm::vec2 uv) {
+    const glm::vec2 anchor = this->viewportToWorld(uv);
+    this->zoom = std::clamp(this->zoom * factor, this->min_zoom, this->max_zoom);
+    this->centre = anchor - (uv - 0.5f) * 2.f * this->halfExtent();
+  }
+
+  void reset() {
+    this->centre = this->world_size * 0.5f;
+    this->zoom = 1.f;
+  }
+};
@@ -1,5 +1,6 @@
 #pragma once
 #include <glad/glad.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <fstream>
@@ -73,19 +74,91 @@ public:
   // Use/activate the shader
   void use() { glUseProgram(ID); }
 
+  // Get the SSBO owned by a binding point, creating it on first use so
+  // buffers are reused across dispatches instead of leaked.
+  uint32_t bindingBuffer(const uint32_t binding_id) {
+    if (binding_id >= this->ssbos.size()) {
+      this->ssbos.resize(binding_id + 1, 0);
+      this->buffer_sizes.resize(binding_id + 1, 0);
+    }
+    if (this->ssbos[binding_id] == 0) {
+      glGenBuffers(1, &this->ssbos[binding_id]);
+    }
+    return this->ssbos[binding_id];
+  }
+
   template <typename T>
   uint32_t setVector(std::vector<T> &vec, const uint32_t binding_id) {
-    uint32_t ssbo;
+    uint32_t ssbo = this->bindingBuffer(binding_id);
 
-    glGenBuffers(1, &ssbo);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
     glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(T) * vec.size(), vec.data(),
-                 GL_STATIC_DRAW);
+                 GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_id, ssbo);
+    this->buffer_sizes[binding_id] = sizeof(T) * vec.size();
+    this->uploaded_bytes += sizeof(T) * vec.size();
+
+    return ssbo;
+  }
+
+  // Upload only elements [first, first + count) when the binding's buffer
+  // already holds vec, otherwise the whole vector.
+  template <typename T>
+  uint32_t updateVector(std::vector<T> &vec, const uint32_t binding_id,
+                        const uint32_t first, const uint32_t count) {
+    uint32_t ssbo = this->bindingBuffer(binding_id);
+    if (this->buffer_sizes[binding_id] != sizeof(T) * vec.size()) {
+      return this->setVector(vec, binding_id);
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    if (count > 0) {
+      glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(T) * first,
+                      sizeof(T) * count, vec.data() + first);
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_id, ssbo);
+    this->uploaded_bytes += sizeof(T) * count;
+
+    return ssbo;
+  }
+
+  // Device side copy of another buffer into a binding point's buffer.
+  uint32_t copyBuffer(const uint32_t source_ssbo, const uint32_t binding_id,
+                      const size_t bytes) {
+    uint32_t ssbo = this->bindingBuffer(binding_id);
+    if (this->buffer_sizes[binding_id] != bytes) {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, NULL, GL_DYNAMIC_DRAW);
+      this->buffer_sizes[binding_id] = bytes;
+    }
+
+    glBindBuffer(GL_COPY_READ_BUFFER, source_ssbo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ssbo);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, bytes);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_id, ssbo);
 
     return ssbo;
   }
 
+  // Bind a buffer owned elsewhere (e.g. ping-pong buffers) to a binding point.
+  void bindBuffer(const uint32_t ssbo, const uint32_t binding_id) {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_id, ssbo);
+  }
+
+  // Allocate an output buffer without uploading anything.
+  template <typename T>
+  uint32_t createVector(const uint32_t size, const uint32_t binding_id) {
+    uint32_t ssbo = this->bindingBuffer(binding_id);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(T) * size, NULL,
+                 GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_id, ssbo);
+    this->buffer_sizes[binding_id] = sizeof(T) * size;
+
+    return ssbo;
+  }
+
   void setFloat(const float value, const std::string &name) {
     uint32_t uniform_loc = glGetUniformLocation(this->ID, name.c_str());
     glUniform1f(uniform_loc, value);
@@ -96,11 +169,17 @@ public:
     glUniform1ui(uniform_loc, value);
   }
 
+  void setVec2(const glm::vec2 value, const std::string &name) {
+    uint32_t uniform_loc = glGetUniformLocation(this->ID, name.c_str());
+    glUniform2f(uniform_loc, value.x, value.y);
+  }
+
   template <typename T>
   void extractVector(uint32_t ssbo_id, std::vector<T> &desintation) {
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_id);
     glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
                        sizeof(T) * desintation.size(), desintation.data());
+    this->read_back_bytes += sizeof(T) * desintation.size();
   }
 
   void executeSync(const uint32_t work_group_size) {
@@ -111,5 +190,30 @@ public:
     glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
   }
 
-  ~ComputeShader() { glDeleteProgram(ID); }
+  void executeSyncWorkGroups(const uint32_t work_group_count) {
+    // Dispatch one work group per item (e.g. per spatial bucket).
+    // Split across y since only 65535 groups per dimension are guaranteed,
+    // shader must flatten with gl_NumWorkGroups.x and range check.
+    if (work_group_count == 0)
+      return;
+    const uint32_t max_groups_x = 65535;
+    const uint32_t groups_x = std::min(work_group_count, max_groups_x);
+    const uint32_t groups_y = (work_group_count + groups_x - 1) / groups_x;
+    glDispatchCompute(groups_x, groups_y, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  }
+
+  ~ComputeShader() {
+    glDeleteBuffers(this->ssbos.size(), this->ssbos.data());
+    glDeleteProgram(ID);
+  }
+
+  // Running totals of bytes sent to and read back from the GPU.
+  uint64_t uploaded_bytes = 0;
+  uint64_t read_back_bytes = 0;
+
+private:
+  std::vector<uint32_t> ssbos;
+  // Allocated size of each binding point's buffer.
+  std::vector<size_t> buffer_sizes;
 };
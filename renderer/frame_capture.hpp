@@ -0,0 +1,293 @@
+#pragma once
+#include <glad/glad.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Renders into an offscreen framebuffer and streams the frames to disk.
+// glReadPixels writes into a ring of pixel buffer objects, so the copy runs
+// on the GPU timeline and a PBO is only mapped once its fence has passed,
+// usually a few frames later. Encoding and file IO run on a writer thread.
+//
+// A path ending in .y4m produces one raw YUV 4:4:4 stream, anything else is
+// a directory prefix for numbered PPM files.
+class FrameCapture {
+public:
+  FrameCapture(const uint32_t _width, const uint32_t _height,
+               const std::string &_output_path, const uint32_t _fps = 60)
+      : width(_width), height(_height), output_path(_output_path),
+        fps(_fps) {
+    const std::string y4m_ext = ".y4m";
+    this->y4m = this->output_path.size() >= y4m_ext.size() &&
+                this->output_path.compare(this->output_path.size() -
+                                              y4m_ext.size(),
+                                          y4m_ext.size(), y4m_ext) == 0;
+    if (!this->y4m) {
+      std::error_code err;
+      std::filesystem::create_directories(this->output_path, err);
+    }
+
+    glGenFramebuffers(1, &this->fbo);
+    glGenRenderbuffers(1, &this->colour_rbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, this->colour_rbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, this->width,
+                          this->height);
+    glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, this->colour_rbo);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      std::cout << "ERROR::FRAMEBUFFER::CAPTURE_INCOMPLETE\n";
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glGenBuffers(ring_size, this->pbos);
+    for (uint32_t i = 0; i < ring_size; i++) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, this->pbos[i]);
+      glBufferData(GL_PIXEL_PACK_BUFFER, this->frameBytes(), NULL,
+                   GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    this->writer = std::thread(&FrameCapture::writeFrames, this);
+  }
+
+  ~FrameCapture() {
+    // Everything still in flight on the GPU is waited for and written.
+    while (this->in_flight > 0) {
+      this->collectOldest(true);
+    }
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+    }
+    this->frame_ready.notify_one();
+    this->writer.join();
+
+    glDeleteBuffers(ring_size, this->pbos);
+    glDeleteRenderbuffers(1, &this->colour_rbo);
+    glDeleteFramebuffers(1, &this->fbo);
+
+    std::cout << "Captured " << this->frames_written << " frames to "
+              << this->output_path << " (" << this->readback_stalls
+              << " readback stalls, " << this->writer_stalls
+              << " writer stalls)\n";
+  }
+
+  // Redirect rendering to the capture target.
+  void begin() {
+    glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
+    glViewport(0, 0, this->width, this->height);
+  }
+
+  // Queue the readback of the frame just rendered and hand any completed
+  // ones to the writer. Only blocks when the whole ring is still in flight.
+  void end() {
+    if (this->in_flight == ring_size) {
+      this->collectOldest(true);
+    }
+
+    const uint32_t slot = (this->oldest + this->in_flight) % ring_size;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, this->fbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, this->pbos[slot]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, this->width, this->height, GL_RGBA, GL_UNSIGNED_BYTE,
+                 (void *)0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    this->fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    this->in_flight++;
+
+    while (this->in_flight > 0 && this->collectOldest(false)) {
+    }
+  }
+
+private:
+  static const uint32_t ring_size = 3;
+  // Frames waiting for the writer before end() starts blocking on it.
+  static const uint32_t max_queued_frames = 8;
+
+  uint32_t width;
+  uint32_t height;
+  std::string output_path;
+  uint32_t fps;
+  bool y4m;
+
+  uint32_t fbo;
+  uint32_t colour_rbo;
+  uint32_t pbos[ring_size];
+  GLsync fences[ring_size] = {};
+  uint32_t oldest = 0;
+  uint32_t in_flight = 0;
+
+  std::thread writer;
+  std::mutex mutex;
+  std::condition_variable frame_ready;
+  std::condition_variable frame_written;
+  std::deque<std::vector<uint8_t>> queued_frames;
+  // Written frame buffers, reused so steady state capture doesn't allocate.
+  std::vector<std::vector<uint8_t>> free_frames;
+  bool stopping = false;
+
+  uint32_t frames_written = 0;
+  uint32_t readback_stalls = 0;
+  uint32_t writer_stalls = 0;
+
+  size_t frameBytes() const { return (size_t)this->width * this->height * 4; }
+
+  // Move the oldest readback to the writer queue if it has landed, or wait
+  // for it when blocking.
+  bool collectOldest(const bool blocking) {
+    GLsync &fence = this->fences[this->oldest];
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    if (status == GL_TIMEOUT_EXPIRED) {
+      if (!blocking)
+        return false;
+      this->readback_stalls++;
+      while (status == GL_TIMEOUT_EXPIRED) {
+        status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                  1000000000);
+      }
+    }
+    glDeleteSync(fence);
+    fence = nullptr;
+
+    std::vector<uint8_t> frame;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      if (this->queued_frames.size() >= max_queued_frames) {
+        this->writer_stalls++;
+        this->frame_written.wait(lock, [this]() {
+          return this->queued_frames.size() < max_queued_frames;
+        });
+      }
+      if (!this->free_frames.empty()) {
+        frame.swap(this->free_frames.back());
+        this->free_frames.pop_back();
+      }
+    }
+    frame.resize(this->frameBytes());
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, this->pbos[this->oldest]);
+    const uint8_t *pixels = (const uint8_t *)glMapBufferRange(
+        GL_PIXEL_PACK_BUFFER, 0, this->frameBytes(), GL_MAP_READ_BIT);
+    if (pixels != nullptr) {
+      std::copy(pixels, pixels + this->frameBytes(), frame.begin());
+    }
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->queued_frames.push_back(std::move(frame));
+    }
+    this->frame_ready.notify_one();
+
+    this->oldest = (this->oldest + 1) % ring_size;
+    this->in_flight--;
+    return true;
+  }
+
+  void writeFrames() {
+    FILE *stream = nullptr;
+    if (this->y4m) {
+      stream = fopen(this->output_path.c_str(), "wb");
+      if (stream == nullptr) {
+        std::cerr << "Failed to open capture output: " << this->output_path
+                  << "\n";
+      } else {
+        fprintf(stream, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n", this->width,
+                this->height, this->fps);
+      }
+    }
+
+    std::vector<uint8_t> converted;
+    while (true) {
+      std::vector<uint8_t> frame;
+      {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->frame_ready.wait(lock, [this]() {
+          return this->stopping || !this->queued_frames.empty();
+        });
+        if (this->queued_frames.empty())
+          break;
+        frame.swap(this->queued_frames.front());
+        this->queued_frames.pop_front();
+      }
+      this->frame_written.notify_one();
+
+      if (this->y4m) {
+        this->convertToYuv444(frame, converted);
+        if (stream != nullptr) {
+          fputs("FRAME\n", stream);
+          fwrite(converted.data(), 1, converted.size(), stream);
+        }
+      } else {
+        this->writePpm(frame, converted);
+      }
+      this->frames_written++;
+
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->free_frames.push_back(std::move(frame));
+    }
+
+    if (stream != nullptr) {
+      fclose(stream);
+    }
+  }
+
+  // Planar BT.601 full range. GL rows run bottom to top, both outputs top
+  // to bottom.
+  void convertToYuv444(const std::vector<uint8_t> &rgba,
+                       std::vector<uint8_t> &yuv) {
+    const size_t plane = (size_t)this->width * this->height;
+    yuv.resize(plane * 3);
+    for (uint32_t y = 0; y < this->height; y++) {
+      const uint8_t *row = &rgba[(size_t)(this->height - 1 - y) * this->width * 4];
+      for (uint32_t x = 0; x < this->width; x++) {
+        const float r = row[x * 4];
+        const float g = row[x * 4 + 1];
+        const float b = row[x * 4 + 2];
+        const size_t i = (size_t)y * this->width + x;
+        yuv[i] = std::clamp(0.299f * r + 0.587f * g + 0.114f * b, 0.f, 255.f);
+        yuv[plane + i] = std::clamp(
+            128.f - 0.168736f * r - 0.331264f * g + 0.5f * b, 0.f, 255.f);
+        yuv[2 * plane + i] = std::clamp(
+            128.f + 0.5f * r - 0.418688f * g - 0.081312f * b, 0.f, 255.f);
+      }
+    }
+  }
+
+  void writePpm(const std::vector<uint8_t> &rgba, std::vector<uint8_t> &rgb) {
+    rgb.resize((size_t)this->width * this->height * 3);
+    for (uint32_t y = 0; y < this->height; y++) {
+      const uint8_t *row = &rgba[(size_t)(this->height - 1 - y) * this->width * 4];
+      for (uint32_t x = 0; x < this->width; x++) {
+        const size_t i = ((size_t)y * this->width + x) * 3;
+        rgb[i] = row[x * 4];
+        rgb[i + 1] = row[x * 4 + 1];
+        rgb[i + 2] = row[x * 4 + 2];
+      }
+    }
+
+    char file_name[32];
+    snprintf(file_name, sizeof(file_name), "frame_%06u.ppm",
+             this->frames_written);
+    const std::string path = this->output_path + "/" + file_name;
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+      std::cerr << "Failed to write frame: " << path << "\n";
+      return;
+    }
+    fprintf(file, "P6\n%u %u\n255\n", this->width, this->height);
+    fwrite(rgb.data(), 1, rgb.size(), file);
+    fclose(file);
+  }
+};
@@ -0,0 +1,161 @@
+#pragma once
+#include <glad/glad.h>
+#include <cstdint>
+#include "compute_shader.hpp"
+
+// GPU radix sort of uint keys which also produces the sorting permutation,
+// plus a gather pass to apply that permutation to any SSBO. Nothing is read
+// back to the host.
+class RadixSort {
+public:
+  RadixSort()
+      : sort_shader("./renderer/shaders/radix_sort.cs.glsl"),
+        gather_shader("./renderer/shaders/gather.cs.glsl") {
+    glGenBuffers(2, this->keys);
+    glGenBuffers(2, this->values);
+    glGenBuffers(1, &this->block_histograms);
+    glGenBuffers(1, &this->scratch);
+  }
+
+  // Number of bits needed for keys in [0, max_key].
+  static uint32_t keyBits(uint32_t max_key) {
+    uint32_t bits = 0;
+    while (max_key > 0) {
+      bits++;
+      max_key >>= 1;
+    }
+    return bits;
+  }
+
+  // Sort the first key_count keys of keys_ssbo, which must be below
+  // 2^key_bits. The input buffer is left untouched.
+  void sort(const uint32_t keys_ssbo, const uint32_t key_count,
+            const uint32_t key_bits) {
+    this->reserve(key_count);
+    const uint32_t block_count = (key_count + block_size - 1) / block_size;
+
+    // Keys may have just been written by a shader.
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_COPY_READ_BUFFER, keys_ssbo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, this->keys[0]);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                        sizeof(uint32_t) * key_count);
+
+    const uint32_t init_values_kernel_id = 0;
+    const uint32_t histogram_kernel_id = 1;
+    const uint32_t scan_kernel_id = 2;
+    const uint32_t scatter_kernel_id = 3;
+
+    this->sort_shader.use();
+    this->sort_shader.setUnsignedInt(key_count, "key_count");
+    this->sort_shader.setUnsignedInt(block_count, "block_count");
+
+    // Permutation starts as the identity.
+    this->sort_shader.bindBuffer(this->values[0], 1);
+    this->sort_shader.setUnsignedInt(init_values_kernel_id, "kernel_id");
+    this->sort_shader.executeSyncWorkGroups((key_count + 255) / 256);
+
+    // Ping-pong between the two key/value buffers, 4 bits per pass.
+    uint32_t src = 0;
+    for (uint32_t shift = 0; shift < key_bits; shift += 4) {
+      const uint32_t dst = 1 - src;
+      this->sort_shader.bindBuffer(this->keys[src], 0);
+      this->sort_shader.bindBuffer(this->values[src], 1);
+      this->sort_shader.bindBuffer(this->keys[dst], 2);
+      this->sort_shader.bindBuffer(this->values[dst], 3);
+      this->sort_shader.bindBuffer(this->block_histograms, 4);
+      this->sort_shader.setUnsignedInt(shift, "shift");
+
+      this->sort_shader.setUnsignedInt(histogram_kernel_id, "kernel_id");
+      this->sort_shader.executeSyncWorkGroups(block_count);
+
+      this->sort_shader.setUnsignedInt(scan_kernel_id, "kernel_id");
+      this->sort_shader.executeSyncWorkGroups(1);
+
+      this->sort_shader.setUnsignedInt(scatter_kernel_id, "kernel_id");
+      this->sort_shader.executeSyncWorkGroups(block_count);
+
+      src = dst;
+    }
+    this->result = src;
+  }
+
+  uint32_t sortedKeys() const { return this->keys[this->result]; }
+
+  // permutation[i] is the original index of the i-th smallest key.
+  uint32_t permutation() const { return this->values[this->result]; }
+
+  // dst[i] = src[permutation[i]], element_size must be a multiple of 4.
+  void gather(const uint32_t src_ssbo, const uint32_t dst_ssbo,
+              const uint32_t element_count, const uint32_t element_size) {
+    this->gather_shader.use();
+    this->gather_shader.bindBuffer(this->permutation(), 0);
+    this->gather_shader.bindBuffer(src_ssbo, 1);
+    this->gather_shader.bindBuffer(dst_ssbo, 2);
+    this->gather_shader.setUnsignedInt(element_count, "element_count");
+    this->gather_shader.setUnsignedInt(element_size / sizeof(uint32_t),
+                                       "words_per_element");
+    // Millions of elements need more than 65535 groups of 64.
+    this->gather_shader.executeSyncWorkGroups((element_count + 63) / 64);
+  }
+
+  // Reorder a buffer through the scratch buffer so its id stays valid.
+  void gatherInPlace(const uint32_t ssbo, const uint32_t element_count,
+                     const uint32_t element_size) {
+    const uint32_t size = element_count * element_size;
+    if (size > this->scratch_size) {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->scratch);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_DYNAMIC_COPY);
+      this->scratch_size = size;
+    }
+
+    this->gather(ssbo, this->scratch, element_count, element_size);
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_COPY_READ_BUFFER, this->scratch);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ssbo);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+  }
+
+  ~RadixSort() {
+    glDeleteBuffers(2, this->keys);
+    glDeleteBuffers(2, this->values);
+    glDeleteBuffers(1, &this->block_histograms);
+    glDeleteBuffers(1, &this->scratch);
+  }
+
+private:
+  // Must match radix_sort.cs.glsl.
+  static const uint32_t radix = 16;
+  static const uint32_t block_size = 1024;
+
+  ComputeShader sort_shader;
+  ComputeShader gather_shader;
+  uint32_t keys[2];
+  uint32_t values[2];
+  uint32_t block_histograms;
+  uint32_t scratch;
+  uint32_t capacity = 0;
+  uint32_t scratch_size = 0;
+  uint32_t result = 0;
+
+  void reserve(const uint32_t key_count) {
+    if (key_count <= this->capacity)
+      return;
+
+    const uint32_t block_count = (key_count + block_size - 1) / block_size;
+    for (uint32_t i = 0; i < 2; i++) {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->keys[i]);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t) * key_count,
+                   NULL, GL_DYNAMIC_COPY);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->values[i]);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t) * key_count,
+                   NULL, GL_DYNAMIC_COPY);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->block_histograms);
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 sizeof(uint32_t) * radix * block_count, NULL,
+                 GL_DYNAMIC_COPY);
+    this->capacity = key_count;
+  }
+};
@@ -1,5 +1,10 @@
 #include "renderer.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -8,53 +13,505 @@
 
 Renderer::Renderer(PhysicSolver &_solver)
     : solver(_solver), shader("renderer/shaders/circle.vs.glsl",
-                              "renderer/shaders/circle.fs.glsl"){};
-
-void Renderer::drawParticles() {
-  const uint32_t particle_count = this->solver.particle_count;
+                              "renderer/shaders/circle.fs.glsl"),
+      ssbo_shader("renderer/shaders/circle_ssbo.vs.glsl",
+                  "renderer/shaders/circle.fs.glsl"),
+      camera(_solver.world_size),
+      blob_shader("renderer/shaders/cell_blob.vs.glsl",
+                  "renderer/shaders/cell_blob.fs.glsl"),
+      splat_shader("renderer/shaders/circle.vs.glsl",
+                   "renderer/shaders/fluid_splat.fs.glsl"),
+      ssbo_splat_shader("renderer/shaders/circle_ssbo.vs.glsl",
+                        "renderer/shaders/fluid_splat.fs.glsl"),
+      surface_shader("renderer/shaders/fullscreen.vs.glsl",
+                     "renderer/shaders/fluid_surface.fs.glsl") {
+  const GLsizeiptr segment_bytes =
+      sizeof(ParticleVertex) * this->solver.particle_count;
+  const GLsizeiptr ring_bytes = segment_bytes * ring_segments;
 
-  // Vertex data: [pos_x, pos_y, radius, col_y, col_g, col_b];
-  float vertex_data[particle_count * 6];
+  glGenVertexArrays(1, &this->vao);
+  glGenBuffers(1, &this->vbo);
 
-  for (uint32_t i = 0; i < particle_count; i++) {
+  glBindVertexArray(this->vao);
+  glBindBuffer(GL_ARRAY_BUFFER, this->vbo);
 
-    vertex_data[i * 6] = this->solver.particles.positions[i].x;
-    vertex_data[i * 6 + 1] = this->solver.particles.positions[i].y;
-    vertex_data[i * 6 + 2] = this->solver.particle_radius;
-    vertex_data[i * 6 + 3] = this->solver.particles.colours[i].r;
-    vertex_data[i * 6 + 4] = this->solver.particles.colours[i].g;
-    vertex_data[i * 6 + 5] = this->solver.particles.colours[i].b;
+  if (GLAD_GL_VERSION_4_4) {
+    // Written through the mapping every frame, never reallocated.
+    const GLbitfield flags =
+        GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_ARRAY_BUFFER, ring_bytes, NULL, flags);
+    this->mapped_ring =
+        (ParticleVertex *)glMapBufferRange(GL_ARRAY_BUFFER, 0, ring_bytes,
+                                           flags);
+  } else {
+    glBufferData(GL_ARRAY_BUFFER, ring_bytes, NULL, GL_STREAM_DRAW);
+    this->staging.resize(this->solver.particle_count);
   }
 
-  uint32_t vao, vbo;
-
-  glGenVertexArrays(1, &vao);
-  glGenBuffers(1, &vbo);
+  const GLsizei stride = sizeof(ParticleVertex);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride,
+                        (void *)offsetof(ParticleVertex, position));
+  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride,
+                        (void *)offsetof(ParticleVertex, prev_position));
+  glVertexAttribIPointer(2, 1, GL_UNSIGNED_BYTE, stride,
+                         (void *)offsetof(ParticleVertex, species));
 
-  glBindVertexArray(vao);
+  glEnableVertexAttribArray(0);
+  glEnableVertexAttribArray(1);
+  glEnableVertexAttribArray(2);
 
-  glBindBuffer(GL_ARRAY_BUFFER, vbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(vertex_data), vertex_data,
-               GL_STATIC_DRAW);
+  // GL 4.3 only guarantees SSBO access from compute and fragment shaders.
+  int32_t max_vertex_ssbos = 0;
+  glGetIntegerv(GL_MAX_VERTEX_SHADER_STORAGE_BLOCKS, &max_vertex_ssbos);
+  this->zero_copy_supported = max_vertex_ssbos >= 2;
+  glGenVertexArrays(1, &this->ssbo_vao);
+  glGenBuffers(1, &this->species_ssbo);
 
-  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)0);
-  glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 6 * sizeof(float),
-                        (void *)(2 * sizeof(float)));
-  glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float),
-                        (void *)(3 * sizeof(float)));
+  // Keys are written from the drawn positions, see rebuildViewGrid.
+  this->view_grid = new SpatialGrid(this->solver.particles.positions,
+                                    this->solver.smoothing_radius);
+  this->bucket_stamps.resize(this->view_grid->spatial_lookup.size() - 1, 0);
 
+  glGenVertexArrays(1, &this->blob_vao);
+  glGenBuffers(1, &this->blob_vbo);
+  glBindVertexArray(this->blob_vao);
+  glBindBuffer(GL_ARRAY_BUFFER, this->blob_vbo);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(CellBlob),
+                        (void *)offsetof(CellBlob, centre));
+  glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(CellBlob),
+                        (void *)offsetof(CellBlob, count));
   glEnableVertexAttribArray(0);
   glEnableVertexAttribArray(1);
-  glEnableVertexAttribArray(2);
+  glVertexAttribDivisor(0, 1);
+  glVertexAttribDivisor(1, 1);
 
   float default_point_size = 10.0f;
   glEnable(GL_PROGRAM_POINT_SIZE); // Enable point size control in shader
   glPointSize(default_point_size);
+};
+
+float Renderer::benchmarkDraw(const uint32_t frames) {
+  uint32_t query;
+  glGenQueries(1, &query);
+
+  // Warm up, also fills every ring segment once.
+  for (uint32_t i = 0; i < ring_segments; i++) {
+    this->drawParticles();
+  }
+  glFinish();
+
+  uint64_t total_ns = 0;
+  for (uint32_t i = 0; i < frames; i++) {
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    this->drawParticles();
+    glEndQuery(GL_TIME_ELAPSED);
+
+    uint64_t frame_ns = 0;
+    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &frame_ns);
+    total_ns += frame_ns;
+  }
+
+  glDeleteQueries(1, &query);
+  return total_ns / 1e6f / frames;
+}
+
+Renderer::~Renderer() {
+  for (GLsync fence : this->segment_fences) {
+    if (fence != nullptr) {
+      glDeleteSync(fence);
+    }
+  }
+  if (this->mapped_ring != nullptr) {
+    glBindBuffer(GL_ARRAY_BUFFER, this->vbo);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+  }
+  glDeleteBuffers(1, &this->vbo);
+  glDeleteVertexArrays(1, &this->vao);
+  glDeleteBuffers(1, &this->species_ssbo);
+  glDeleteVertexArrays(1, &this->ssbo_vao);
+  glDeleteBuffers(1, &this->blob_vbo);
+  glDeleteVertexArrays(1, &this->blob_vao);
+  delete this->view_grid;
+  if (this->surface_fbo != 0) {
+    glDeleteFramebuffers(1, &this->surface_fbo);
+    glDeleteTextures(1, &this->surface_texture);
+  }
+}
+
+void Renderer::waitForSegment(const uint32_t segment) {
+  // The fence is signalled once the draw reading this segment has finished.
+  GLsync &fence = this->segment_fences[segment];
+  if (fence == nullptr)
+    return;
+
+  const GLuint64 timeout_ns = 1000000000;
+  GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout_ns);
+  while (result == GL_TIMEOUT_EXPIRED) {
+    result = glClientWaitSync(fence, 0, timeout_ns);
+  }
+  glDeleteSync(fence);
+  fence = nullptr;
+}
+
+bool Renderer::canDrawFromSsbo() {
+  // Only when the newest positions are still on the GPU, otherwise they were
+  // produced on the host and need uploading anyway. With the solver on
+  // another thread its buffers may be mid update, so snapshots only.
+  return !this->solver.publish_snapshots && this->zero_copy &&
+         this->zero_copy_supported && this->solver.gpu_positions_ssbo != 0;
+}
+
+bool Renderer::selectSource() {
+  if (!this->solver.publish_snapshots) {
+    this->source_positions = &this->solver.particles.positions;
+    this->source_previous_positions = this->source_positions;
+    this->source_species = &this->solver.particles.species;
+    this->interpolation_alpha = 1.f;
+    return true;
+  }
+
+  // The snapshot being replaced becomes the start of the interpolation. It
+  // has to be copied since the solver reuses it once consumed.
+  if (this->solver.snapshots.fresh()) {
+    const ParticleSnapshot &replaced = this->solver.snapshots.readBuffer();
+    if (this->interpolate) {
+      this->previous_positions = replaced.positions;
+      this->previous_publish_time = replaced.publish_time;
+      this->previous_reorder_count = replaced.reorder_count;
+    }
+    this->solver.snapshots.consume();
+  }
+
+  const ParticleSnapshot &snapshot = this->solver.snapshots.readBuffer();
+  this->source_positions = &snapshot.positions;
+  this->source_species = &snapshot.species;
+  if (snapshot.positions.empty())
+    return false;
+
+  this->source_previous_positions = this->source_positions;
+  this->interpolation_alpha = 1.f;
+  const double interval = snapshot.publish_time - this->previous_publish_time;
+  // Index i must be the same particle in both, cell sorting breaks that.
+  if (this->interpolate && interval > 0.0 &&
+      this->previous_positions.size() == snapshot.positions.size() &&
+      this->previous_reorder_count == snapshot.reorder_count) {
+    // Reaches the latest state just as the next one is due.
+    const double now = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now().time_since_epoch())
+                           .count();
+    this->source_previous_positions = &this->previous_positions;
+    this->interpolation_alpha =
+        glm::clamp((float)((now - snapshot.publish_time) / interval), 0.f, 1.f);
+  }
+  return true;
+}
+
+void Renderer::setPalette(Shader &program) {
+  const uint32_t size =
+      std::min((uint32_t)this->palette.size(), max_palette_size);
+  program.setVec3Array("palette", this->palette.data(), size);
+}
+
+void Renderer::rebuildViewGrid() {
+  this->view_grid->updateCellKeys(*this->source_positions);
+  this->view_grid->updateFromCellKeys();
+}
+
+void Renderer::visibleCellRange(glm::ivec2 &min_cell, glm::ivec2 &max_cell) {
+  // One cell of margin covers circles and kernels overlapping the edge and
+  // particles interpolating in from a neighbouring cell.
+  const glm::ivec2 world_max_cell =
+      this->view_grid->positionToCellCoord(this->solver.world_size);
+  min_cell = glm::clamp(
+      this->view_grid->positionToCellCoord(this->camera.visibleMin()) - 1,
+      glm::ivec2(0), world_max_cell);
+  max_cell = glm::clamp(
+      this->view_grid->positionToCellCoord(this->camera.visibleMax()) + 1,
+      glm::ivec2(0), world_max_cell);
+}
+
+const std::vector<int32_t> *Renderer::cullParticles() {
+  // Nothing to skip while the whole world is in view.
+  if (!this->culling || this->camera.zoom <= 1.f)
+    return nullptr;
+
+  this->rebuildViewGrid();
+  glm::ivec2 min_cell, max_cell;
+  this->visibleCellRange(min_cell, max_cell);
+
+  const std::vector<int32_t> &lookup = this->view_grid->spatial_lookup;
+  const std::vector<int32_t> &indicies = this->view_grid->spatial_indicies;
+  this->cull_stamp++;
+  this->visible_particles.clear();
+  for (int32_t y = min_cell.y; y <= max_cell.y; y++) {
+    for (int32_t x = min_cell.x; x <= max_cell.x; x++) {
+      const int32_t hash = this->view_grid->cellCoordToHash(glm::ivec2(x, y));
+      if (this->bucket_stamps[hash] == this->cull_stamp)
+        continue;
+      this->bucket_stamps[hash] = this->cull_stamp;
+      this->visible_particles.insert(this->visible_particles.end(),
+                                     indicies.begin() + lookup[hash],
+                                     indicies.begin() + lookup[hash + 1]);
+    }
+  }
+  return &this->visible_particles;
+}
+
+float Renderer::pixelsPerWorldUnit() {
+  int32_t viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  return 1.f / this->camera.worldPerPixel(viewport[2]);
+}
+
+bool Renderer::useCellLod() {
+  if (!this->culling)
+    return false;
+  const float radius_pixels =
+      this->solver.particle_radius * this->pixelsPerWorldUnit();
+  return radius_pixels < this->lod_min_radius_pixels;
+}
+
+void Renderer::drawCellBlobs() {
+  this->rebuildViewGrid();
+  glm::ivec2 min_cell, max_cell;
+  this->visibleCellRange(min_cell, max_cell);
 
-  glm::mat4 projection = glm::ortho(0.0f, this->solver.world_size.x, 0.0f,
-                                    this->solver.world_size.y, 0.f, 1.0f);
-  this->shader.use();
-  shader.setMat4("projection", projection);
+  // Bucket sizes stand in for cell counts. A bucket shared by several cells
+  // is attributed to the first one visited.
+  const std::vector<int32_t> &lookup = this->view_grid->spatial_lookup;
+  const float cell_width = this->view_grid->cell_width;
+  this->cull_stamp++;
+  this->blobs.clear();
+  float max_count = 1.f;
+  for (int32_t y = min_cell.y; y <= max_cell.y; y++) {
+    for (int32_t x = min_cell.x; x <= max_cell.x; x++) {
+      const int32_t hash = this->view_grid->cellCoordToHash(glm::ivec2(x, y));
+      const int32_t count = lookup[hash + 1] - lookup[hash];
+      if (count == 0 || this->bucket_stamps[hash] == this->cull_stamp)
+        continue;
+      this->bucket_stamps[hash] = this->cull_stamp;
+      const glm::vec2 centre = (glm::vec2(x, y) + 0.5f) * cell_width;
+      this->blobs.push_back({centre, (float)count});
+      max_count = std::max(max_count, (float)count);
+    }
+  }
+  this->drawn_instances = this->blobs.size();
+
+  // Few enough to orphan and refill every frame.
+  glBindBuffer(GL_ARRAY_BUFFER, this->blob_vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(CellBlob) * this->blobs.size(),
+               this->blobs.data(), GL_STREAM_DRAW);
+
+  glm::mat4 projection = this->camera.projection();
+  this->blob_shader.use();
+  this->blob_shader.setMat4("projection", projection);
+  // Reaching into the neighbouring cells blends blobs into a continuous field.
+  this->blob_shader.setFloat("blob_radius", cell_width);
+  this->blob_shader.setFloat("max_count", max_count);
+  this->setPalette(this->blob_shader);
+
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glBindVertexArray(this->blob_vao);
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, this->blobs.size());
+  glDisable(GL_BLEND);
+}
+
+void Renderer::drawParticles() {
+  // Nothing published yet.
+  if (!this->selectSource())
+    return;
+
+  if (this->useCellLod()) {
+    this->drawCellBlobs();
+    return;
+  }
+
+  if (this->fluid_surface) {
+    this->drawFluidSurface();
+    return;
+  }
+
+  const std::vector<int32_t> *visible = this->cullParticles();
+  if (visible == nullptr && this->canDrawFromSsbo()) {
+    this->drawParticlesFromSsbo(this->ssbo_shader, this->instanced_quads, 1.f);
+  } else {
+    this->drawParticlesFromRing(this->shader, this->instanced_quads, 1.f,
+                                visible);
+  }
+}
+
+void Renderer::drawParticlesFromRing(Shader &program, const bool quads,
+                                     const float radius_scale,
+                                     const std::vector<int32_t> *indices) {
+  const uint32_t particle_count =
+      indices != nullptr ? indices->size() : this->solver.particle_count;
+  const uint32_t segment = this->ring_index;
+  const uint32_t first_vertex = segment * this->solver.particle_count;
+
+  this->waitForSegment(segment);
+
+  ParticleVertex *vertex_data = this->mapped_ring != nullptr
+                                    ? this->mapped_ring + first_vertex
+                                    : this->staging.data();
+
+  const std::vector<glm::vec2> &positions = *this->source_positions;
+  const std::vector<glm::vec2> &prev_positions =
+      *this->source_previous_positions;
+  const std::vector<uint8_t> &species = *this->source_species;
+  for (uint32_t i = 0; i < particle_count; i++) {
+    const int32_t p_i = indices != nullptr ? (*indices)[i] : i;
+    vertex_data[i].position = positions[p_i];
+    vertex_data[i].prev_position = prev_positions[p_i];
+    vertex_data[i].species = species[p_i];
+  }
+  this->drawn_instances = particle_count;
+
+  glBindVertexArray(this->vao);
+  if (this->mapped_ring == nullptr) {
+    glBindBuffer(GL_ARRAY_BUFFER, this->vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(ParticleVertex) * first_vertex,
+                    sizeof(ParticleVertex) * particle_count,
+                    this->staging.data());
+  }
+
+  glm::mat4 projection = this->camera.projection();
+  program.use();
+  program.setMat4("projection", projection);
+  program.setBool("quad_instances", quads);
+  program.setFloat("particle_radius", this->solver.particle_radius);
+  program.setFloat("radius_scale", radius_scale);
+  program.setFloat("pixels_per_unit", this->pixelsPerWorldUnit());
+  program.setFloat("interpolation_alpha", this->interpolation_alpha);
+  this->setPalette(program);
 
-  glDrawArrays(GL_POINTS, 0, particle_count);
+  if (quads) {
+    // Attributes advance per instance, base instance selects the segment.
+    glVertexAttribDivisor(0, 1);
+    glVertexAttribDivisor(1, 1);
+    glVertexAttribDivisor(2, 1);
+    glDrawArraysInstancedBaseInstance(GL_TRIANGLE_STRIP, 0, 4, particle_count,
+                                      first_vertex);
+  } else {
+    glVertexAttribDivisor(0, 0);
+    glVertexAttribDivisor(1, 0);
+    glVertexAttribDivisor(2, 0);
+    glDrawArrays(GL_POINTS, first_vertex, particle_count);
+  }
+
+  this->segment_fences[segment] =
+      glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  this->ring_index = (this->ring_index + 1) % ring_segments;
 };
+
+void Renderer::drawParticlesFromSsbo(Shader &program, const bool quads,
+                                     const float radius_scale) {
+  if (this->solver.species_changed) {
+    // Read back as packed uints, so round the size up to whole words.
+    const uint32_t species_bytes = this->solver.particle_count;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->species_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (species_bytes + 3) & ~3u, NULL,
+                 GL_STATIC_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, species_bytes,
+                    this->solver.particles.species.data());
+    this->solver.species_changed = false;
+  }
+
+  // Binding points are shared with the compute passes, so rebind each frame.
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, this->solver.gpu_positions_ssbo);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, this->species_ssbo);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+  glm::mat4 projection = this->camera.projection();
+  program.use();
+  program.setMat4("projection", projection);
+  program.setFloat("particle_radius", this->solver.particle_radius);
+  program.setBool("quad_instances", quads);
+  program.setFloat("radius_scale", radius_scale);
+  program.setFloat("pixels_per_unit", this->pixelsPerWorldUnit());
+  this->setPalette(program);
+
+  this->drawn_instances = this->solver.particle_count;
+  glBindVertexArray(this->ssbo_vao);
+  if (quads) {
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, this->solver.particle_count);
+  } else {
+    glDrawArrays(GL_POINTS, 0, this->solver.particle_count);
+  }
+}
+
+void Renderer::resizeSurfaceTarget(const glm::ivec2 size) {
+  if (size == this->surface_size)
+    return;
+  this->surface_size = size;
+
+  if (this->surface_fbo == 0) {
+    glGenFramebuffers(1, &this->surface_fbo);
+    glGenTextures(1, &this->surface_texture);
+  }
+
+  // Single channel float so overlapping kernels accumulate without clamping.
+  glBindTexture(GL_TEXTURE_2D, this->surface_texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, size.x, size.y, 0, GL_RED, GL_FLOAT,
+               NULL);
+  // Bilinear upsampling already smooths the low resolution field.
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, this->surface_fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         this->surface_texture, 0);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    std::cout << "ERROR::FRAMEBUFFER::SURFACE_INCOMPLETE\n";
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void Renderer::drawFluidSurface() {
+  // The caller's target, the window or e.g. a capture framebuffer.
+  int32_t viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  int32_t target_fbo = 0;
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target_fbo);
+  const glm::ivec2 splat_size =
+      glm::max(glm::ivec2(glm::vec2(viewport[2], viewport[3]) *
+                          this->surface_resolution_scale),
+               glm::ivec2(1));
+  this->resizeSurfaceTarget(splat_size);
+
+  // Splat: every particle adds its kernel into the low resolution field.
+  glBindFramebuffer(GL_FRAMEBUFFER, this->surface_fbo);
+  glViewport(0, 0, splat_size.x, splat_size.y);
+  glClearColor(0.f, 0.f, 0.f, 0.f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_ONE, GL_ONE);
+
+  // Kernels span the smoothing radius so neighbours overlap into a surface.
+  const float radius_scale =
+      this->solver.smoothing_radius / this->solver.particle_radius;
+  const std::vector<int32_t> *visible = this->cullParticles();
+  if (visible == nullptr && this->canDrawFromSsbo()) {
+    this->drawParticlesFromSsbo(this->ssbo_splat_shader, true, radius_scale);
+  } else {
+    this->drawParticlesFromRing(this->splat_shader, true, radius_scale,
+                                visible);
+  }
+
+  // Threshold, smooth and shade at screen resolution over the background.
+  glBindFramebuffer(GL_FRAMEBUFFER, target_fbo);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, this->surface_texture);
+  this->surface_shader.use();
+  this->surface_shader.setInt("density_texture", 0);
+  this->surface_shader.setFloat("threshold", this->surface_threshold);
+  glBindVertexArray(this->ssbo_vao);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+
+  glDisable(GL_BLEND);
+}
@@ -1,10 +1,127 @@
 #pragma once
 #include "../physics/physics.hpp"
+#include "../physics/spatial_grid.hpp"
+#include "camera.hpp"
 #include "shader.hpp"
 
+// One particle in the vertex ring. Radius and colour come from uniforms.
+struct ParticleVertex {
+  glm::vec2 position;
+  glm::vec2 prev_position;
+  uint8_t species;
+};
+
+// One visible grid cell drawn in place of its particles when zoomed out.
+struct CellBlob {
+  glm::vec2 centre;
+  float count;
+};
+
 struct Renderer {
   PhysicSolver &solver;
   Shader shader;
+
+  // Colour of each species, indexed by Particles::species in the shaders.
+  static constexpr uint32_t max_palette_size = 16;
+  std::vector<glm::vec3> palette = {glm::vec3(35.f, 137.f, 218.f) / 255.f};
+
+  // The ring holds one frame per segment, so the host fills one while the
+  // GPU may still be drawing the other two.
+  static const uint32_t ring_segments = 3;
+  uint32_t vao;
+  uint32_t vbo;
+  // Persistently mapped ring, or nullptr without GL 4.4 buffer storage.
+  ParticleVertex *mapped_ring = nullptr;
+  // Fallback path, filled on the host then copied with glBufferSubData.
+  std::vector<ParticleVertex> staging;
+  GLsync segment_fences[ring_segments] = {};
+  uint32_t ring_index = 0;
+  // Particle state drawn this frame, the solver's own arrays or the latest
+  // snapshot when it runs on another thread.
+  const std::vector<glm::vec2> *source_positions = nullptr;
+  const std::vector<uint8_t> *source_species = nullptr;
+  // Blend from the previous to the latest snapshot in the vertex shader,
+  // running one simulation interval behind so a slow solver still moves
+  // smoothly at the display rate.
+  bool interpolate = true;
+  const std::vector<glm::vec2> *source_previous_positions = nullptr;
+  float interpolation_alpha = 1.f;
+  std::vector<glm::vec2> previous_positions;
+  double previous_publish_time = 0.0;
+  uint64_t previous_reorder_count = 0;
+
+  // Draw each particle as an instanced quad clipped to a circle in the
+  // fragment shader. Points are limited by the implementation's maximum
+  // point size.
+  bool instanced_quads = true;
+
+  // Zero copy path: positions come from the solver's SSBO and species from
+  // an SSBO only re-uploaded when the solver reorders them.
+  bool zero_copy = true;
+  bool zero_copy_supported;
+  Shader ssbo_shader;
+  // Attribute-less, core profile still needs a VAO bound to draw.
+  uint32_t ssbo_vao;
+  uint32_t species_ssbo;
+
+  Camera camera;
+  // When zoomed in, only upload and draw particles in the buckets of cells
+  // overlapping the view. The grid is keyed from the positions being drawn,
+  // so it also works on snapshots. Cells that hash to the same bucket may
+  // pull in a few off screen particles, which are simply clipped.
+  bool culling = true;
+  SpatialGrid *view_grid;
+  std::vector<int32_t> visible_particles;
+  // Frame each bucket was last gathered in, so a bucket shared by several
+  // visible cells is only drawn once.
+  std::vector<uint32_t> bucket_stamps;
+  uint32_t cull_stamp = 0;
+  // Below this on-screen particle radius draw one blob per visible cell,
+  // shaded by its bucket's particle count, instead of sub-pixel particles.
+  float lod_min_radius_pixels = 0.75f;
+  Shader blob_shader;
+  uint32_t blob_vao;
+  uint32_t blob_vbo;
+  std::vector<CellBlob> blobs;
+  // Particles or blobs in the last drawParticles call.
+  uint32_t drawn_instances = 0;
+
+  // Screen space fluid surface: particle kernels are splatted additively
+  // into a float target at surface_resolution_scale of the viewport, then
+  // thresholded, smoothed and shaded in one full screen pass. Cost then
+  // scales with pixels rather than overlapping circles.
+  bool fluid_surface = false;
+  float surface_resolution_scale = 0.25f;
+  // Summed kernel weight at which a pixel counts as inside the fluid.
+  float surface_threshold = 0.6f;
+  Shader splat_shader;
+  Shader ssbo_splat_shader;
+  Shader surface_shader;
+  uint32_t surface_fbo = 0;
+  uint32_t surface_texture = 0;
+  glm::ivec2 surface_size = glm::ivec2(0);
+
   Renderer(PhysicSolver &_solver);
+  ~Renderer();
+  bool selectSource();
+  void setPalette(Shader &program);
+  bool canDrawFromSsbo();
   void drawParticles();
+  void drawParticlesFromRing(Shader &program, const bool quads,
+                             const float radius_scale,
+                             const std::vector<int32_t> *indices = nullptr);
+  void drawParticlesFromSsbo(Shader &program, const bool quads,
+                             const float radius_scale);
+  void rebuildViewGrid();
+  void visibleCellRange(glm::ivec2 &min_cell, glm::ivec2 &max_cell);
+  const std::vector<int32_t> *cullParticles();
+  // Screen pixels per world unit in the current viewport.
+  float pixelsPerWorldUnit();
+  bool useCellLod();
+  void drawCellBlobs();
+  void resizeSurfaceTarget(const glm::ivec2 size);
+  void drawFluidSurface();
+  void waitForSegment(const uint32_t segment);
+  // Mean GPU time of a drawParticles call in ms, from timer queries.
+  float benchmarkDraw(const uint32_t frames);
 };
@@ -107,6 +107,12 @@ public:
     glUniform3i(location, v.x, v.y, v.z);
   }
 
+  void setVec3Array(const std::string &name, const glm::vec3 *values,
+                    const int count) const {
+    unsigned int location = glGetUniformLocation(ID, name.c_str());
+    glUniform3fv(location, count, glm::value_ptr(values[0]));
+  }
+
   void setMat4(const std::string &name, glm::mat4 &matrix) const {
     unsigned int location = glGetUniformLocation(ID, name.c_str());
     glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(matrix));
@@ -0,0 +1,16 @@
+#version 430 core
+
+in float density;
+in vec2 local_uv;
+
+// Blobs aggregate every species, so they take the first colour.
+uniform vec3 palette[16];
+
+out vec4 out_color;
+
+void main() {
+    float falloff = 1.0 - dot(local_uv, local_uv);
+    if (falloff <= 0.0)
+        discard;
+    out_color = vec4(palette[0], density * falloff * falloff);
+}
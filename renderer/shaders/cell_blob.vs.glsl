@@ -0,0 +1,20 @@
+#version 430 core
+
+// One instanced quad per visible grid cell, see Renderer::drawCellBlobs.
+layout (location = 0) in vec2 a_centre;
+layout (location = 1) in float a_count;
+
+uniform mat4 projection;
+uniform float blob_radius;
+// Largest count among the visible cells, maps to full opacity.
+uniform float max_count;
+
+out float density;
+out vec2 local_uv;
+
+void main() {
+    local_uv = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+    vec2 pos = a_centre + local_uv * blob_radius;
+    gl_Position = projection * vec4(pos, 0.0, 1.0);
+    density = a_count / max_count;
+}
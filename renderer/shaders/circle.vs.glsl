@@ -1,22 +1,36 @@
 #version 430 core
 
 layout (location = 0) in vec2 a_pos;
-layout (location = 1) in float a_radius;
-layout (location = 2) in vec3 a_color;
+layout (location = 1) in vec2 a_prev_pos;
+layout (location = 2) in uint a_species;
 
 uniform mat4 projection;
+uniform float particle_radius;
+// Colour of each species, see Renderer::palette.
+uniform vec3 palette[16];
+// 0 draws the previous snapshot, 1 the latest.
+uniform float interpolation_alpha;
+// True when drawing one instanced 4 vertex strip per particle, the
+// attributes then advance per instance. Otherwise one point per particle.
+uniform bool quad_instances;
+// Grows the drawn circle past the particle, e.g. to splat a kernel.
+uniform float radius_scale;
+// Points are sized in pixels, this follows the camera's zoom.
+uniform float pixels_per_unit;
 
 out vec3 frag_color;
-out vec2 center;
-out float radius;
+// Position inside the circle's bounding square, -1 to 1 on each axis.
+out vec2 local_uv;
 
 void main() {
-    vec4 pos = projection * vec4(a_pos, 0.0, 1.0);
-    gl_Position = pos;
-    gl_PointSize = 2.0 * a_radius;
+    vec2 pos = mix(a_prev_pos, a_pos, interpolation_alpha);
+    local_uv = vec2(0.0);
+    if (quad_instances) {
+        local_uv = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+        pos += local_uv * particle_radius * radius_scale;
+    }
+    gl_Position = projection * vec4(pos, 0.0, 1.0);
+    gl_PointSize = 2.0 * particle_radius * radius_scale * pixels_per_unit;
     
-    frag_color = a_color; 
-    center = a_pos;
-    radius = a_radius;
+    frag_color = palette[min(a_species, 15u)]; 
 }
-
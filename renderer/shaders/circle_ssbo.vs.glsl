@@ -0,0 +1,39 @@
+#version 430 core
+
+// Same outputs as circle.vs.glsl, but fetches each particle straight from
+// the simulation buffers instead of vertex attributes.
+layout(std430, binding = 0) readonly buffer positions_ssbo {
+    vec2 positions[];
+};
+
+// One byte per particle, four to a uint as std430 has no 8 bit type.
+layout(std430, binding = 1) readonly buffer species_ssbo {
+    uint species[];
+};
+
+uniform mat4 projection;
+uniform float particle_radius;
+uniform vec3 palette[16];
+uniform bool quad_instances;
+// Grows the drawn circle past the particle, e.g. to splat a kernel.
+uniform float radius_scale;
+// Points are sized in pixels, this follows the camera's zoom.
+uniform float pixels_per_unit;
+
+out vec3 frag_color;
+out vec2 local_uv;
+
+void main() {
+    int p_i = quad_instances ? gl_InstanceID : gl_VertexID;
+    vec2 pos = positions[p_i];
+    local_uv = vec2(0.0);
+    if (quad_instances) {
+        local_uv = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+        pos += local_uv * particle_radius * radius_scale;
+    }
+    gl_Position = projection * vec4(pos, 0.0, 1.0);
+    gl_PointSize = 2.0 * particle_radius * radius_scale * pixels_per_unit;
+
+    uint s = (species[p_i >> 2] >> ((p_i & 3) * 8)) & 0xffu;
+    frag_color = palette[min(s, 15u)];
+}
@@ -26,8 +26,33 @@ layout(std430, binding = 5) buffer ssbo6 {
     int spatial_indicies[];
 };
 
+// Outputs of the fused step. Written separately from positions/velocities
+// since neighbours still read the current state.
+layout(std430, binding = 6) buffer ssbo7 {
+    int cell_keys[];
+};
+
+layout(std430, binding = 7) buffer ssbo8 {
+    vec2 next_positions[];
+};
+
+layout(std430, binding = 8) buffer ssbo9 {
+    vec2 next_velocities[];
+};
+
+// Invocation to particle mapping, groups particles with similar neighbour
+// counts into the same work group.
+layout(std430, binding = 9) buffer ssbo10 {
+    int dispatch_order[];
+};
+
 // Determines which kernel function is actually executed.
 uniform uint kernel_id;
+// Non zero when particle centric kernels should go through dispatch_order.
+uniform uint scheduled_dispatch;
+// Invocations of the particle centric kernels, particle_count unless only a
+// subset listed in dispatch_order is run (e.g. co-execution with the CPU).
+uniform uint dispatch_count;
 
 uniform float dt;
 uniform uint particle_count; 
@@ -45,21 +70,62 @@ uniform float pressure_multiplier;
 uniform float near_pressure_multiplier;
 uniform float viscosity_strength;
 
+uniform vec2 world_size;
+uniform float particle_radius;
+uniform float boundary_damping;
+
+// Cell tiled dispatch: one work group per spatial bucket. The group loads the
+// 3x3 neighbourhood of its cell into shared memory once and every particle in
+// the bucket is evaluated against that tile instead of global memory.
+// Particle arrays must be sorted by cell for the tile loads to be coalesced.
+const uint tile_capacity = 512;
+shared vec2 tile_positions[tile_capacity];
+shared vec2 tile_velocities[tile_capacity];
+shared vec2 tile_densities[tile_capacity];
+shared int tile_indices[tile_capacity];
+
+// Stages shared by the particle centric and cell tiled kernels.
+const uint stage_density = 0;
+const uint stage_forces = 1;
+const uint stage_fused_step = 2;
+
 void calcDensity(int p_i);
 void applyFluidForces(int p_i);
+void fusedStep(int p_i);
+void runCellTiled(uint stage);
 
 void main() {
+    // Tiled kernels index by work group rather than invocation.
+    if (kernel_id == 2) {
+        runCellTiled(stage_density);
+        return;
+    }
+    if (kernel_id == 3) {
+        runCellTiled(stage_forces);
+        return;
+    }
+    if (kernel_id == 5) {
+        runCellTiled(stage_fused_step);
+        return;
+    }
+
     int p_i = int(gl_GlobalInvocationID.x); 
     // Since each work group has 64 local workers, must do range check because particle count is probably not a multiple of 64.
-    if (p_i >= particle_count) 
+    if (p_i >= dispatch_count) 
         return;
 
+    if (scheduled_dispatch != 0)
+        p_i = dispatch_order[p_i];
+
     if (kernel_id == 0) {
         calcDensity(p_i);
     }
     else if (kernel_id == 1) {
         applyFluidForces(p_i);
     }
+    else if (kernel_id == 4) {
+        fusedStep(p_i);
+    }
 }
 
 float poly6Kernel(float r) {
@@ -133,7 +199,7 @@ vec2 densityToPressure(float density, float near_density) {
     return vec2(pressure, near_pressure);
 }
 
-void applyFluidForces(int p_i) {
+vec2 calcFluidForce(int p_i) {
     vec2 pos = positions[p_i];
     ivec2 cell_coord = posToCellCoord(pos);
 
@@ -196,6 +262,191 @@ void applyFluidForces(int p_i) {
 
     vec2 grav_force = vec2(0.0, -9.81) * particle_mass / curr_density;
     // vec2 grav_force = vec2(0.0, 0.0) * curr_density;
-    forces[p_i] = pressure_force + visc_force + grav_force;
-    // forces[p_i] = grav_force;
+    return pressure_force + visc_force + grav_force;
+    // return grav_force;
+}
+
+void applyFluidForces(int p_i) {
+    forces[p_i] = calcFluidForce(p_i);
+}
+
+// Integrate, constrain to the screen and key the new cell in one pass so the
+// force never has to leave the register file. Mirrors
+// PhysicSolver::integrateAndConstrain on the host.
+void integrateParticle(int p_i, vec2 force) {
+    vec2 vel = velocities[p_i] + force / densities[p_i][0] * dt;
+    vec2 pos = positions[p_i] + vel * dt;
+
+    // Right/left
+    if (pos.x + particle_radius > world_size.x) {
+        pos.x = world_size.x - particle_radius;
+        vel.x *= -1.0 * boundary_damping;
+    } else if (pos.x - particle_radius < 0.0) {
+        pos.x = particle_radius;
+        vel.x *= -1.0 * boundary_damping;
+    }
+
+    // Top/bottom
+    if (pos.y + particle_radius > world_size.y) {
+        pos.y = world_size.y - particle_radius;
+        vel.y *= -1.0 * boundary_damping;
+    } else if (pos.y - particle_radius < 0.0) {
+        pos.y = particle_radius;
+        vel.y *= -1.0 * boundary_damping;
+    }
+
+    next_positions[p_i] = pos;
+    next_velocities[p_i] = vel;
+    cell_keys[p_i] = cellCoordToHash(posToCellCoord(pos));
+}
+
+void fusedStep(int p_i) {
+    integrateParticle(p_i, calcFluidForce(p_i));
+}
+
+void calcDensityTiled(int p_i, uint tile_size) {
+    vec2 pos = positions[p_i];
+
+    float density = 0.0;
+    float density_near = 0.0;
+
+    for (uint i = 0; i < tile_size; i++) {
+        const float r = distance(pos, tile_positions[i]);
+        if (r < h) {
+            density += particle_mass * poly6Kernel(r);
+        }
+    }
+
+    densities[p_i][0] = density;
+    densities[p_i][1] = density_near;
+}
+
+vec2 calcFluidForceTiled(int p_i, uint tile_size) {
+    vec2 pos = positions[p_i];
+    vec2 vel = velocities[p_i];
+
+    vec2 pressure_force = vec2(0.0, 0.0);
+    vec2 visc_force = vec2(0.0, 0.0);
+
+    float curr_density = densities[p_i][0];
+    float curr_near_density = densities[p_i][1];
+    vec2 curr_dual_pressure = densityToPressure(curr_density, curr_near_density);
+    float curr_pressure = curr_dual_pressure[0];
+    float curr_near_pressure = curr_dual_pressure[1];
+
+    for (uint i = 0; i < tile_size; i++) {
+        // Skip self
+        if (tile_indices[i] == p_i)
+            continue;
+
+        const float r = distance(pos, tile_positions[i]);
+        if (r < h) {
+            float neighbour_density = tile_densities[i][0];
+            float neighbour_near_density = tile_densities[i][1];
+
+            vec2 neighbour_dual_pressure = densityToPressure(neighbour_density, neighbour_near_density);
+            float neighbour_pressure = neighbour_dual_pressure[0];
+
+            float shared_pressure = 0.5 * (curr_pressure + neighbour_pressure);
+
+            vec2 rij = normalize(tile_positions[i] - pos);
+
+            pressure_force += -rij * particle_mass * spikyGradKernel(r) * shared_pressure / neighbour_density;
+            visc_force += particle_mass * laplacianKernel(r) * (tile_velocities[i] - vel) / neighbour_density;
+        }
+    }
+
+    visc_force *= viscosity_strength;
+
+    vec2 grav_force = vec2(0.0, -9.81) * particle_mass / curr_density;
+    return pressure_force + visc_force + grav_force;
+}
+
+void runCellTiled(uint stage) {
+    bool needs_dynamics = stage != stage_density;
+
+    // Flatten the 2D dispatch, see ComputeShader::executeSyncWorkGroups.
+    uint bucket = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+    // All branches below depend only on the bucket so the whole group takes
+    // them together, keeping the barrier in uniform control flow.
+    if (bucket >= bucket_count)
+        return;
+
+    int start = spatial_lookup[bucket];
+    int end = spatial_lookup[bucket + 1];
+    if (start == end)
+        return;
+
+    // The tile covers the neighbourhood of the first particle's cell. Hash
+    // collisions can put particles of other cells in the same bucket, those
+    // fall back to the global memory path.
+    ivec2 tile_cell = posToCellCoord(positions[spatial_indicies[start]]);
+
+    int range_starts[9];
+    int range_ends[9];
+    uint tile_size = 0;
+    for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+            int r_i = (y + 1) * 3 + (x + 1);
+            int curr_hash = cellCoordToHash(tile_cell + ivec2(x, y));
+            range_starts[r_i] = spatial_lookup[curr_hash];
+            range_ends[r_i] = spatial_lookup[curr_hash + 1];
+            tile_size += uint(range_ends[r_i] - range_starts[r_i]);
+        }
+    }
+
+    uint local_size = gl_WorkGroupSize.x;
+    uint local_id = gl_LocalInvocationID.x;
+
+    // Neighbourhood too dense to fit, use the particle centric path.
+    if (tile_size > tile_capacity) {
+        for (int i = start + int(local_id); i < end; i += int(local_size)) {
+            int p_i = spatial_indicies[i];
+            if (stage == stage_density)
+                calcDensity(p_i);
+            else if (stage == stage_forces)
+                applyFluidForces(p_i);
+            else
+                fusedStep(p_i);
+        }
+        return;
+    }
+
+    // Cooperatively load the tile.
+    for (uint t = local_id; t < tile_size; t += local_size) {
+        uint offset = t;
+        int r_i = 0;
+        while (offset >= uint(range_ends[r_i] - range_starts[r_i])) {
+            offset -= uint(range_ends[r_i] - range_starts[r_i]);
+            r_i++;
+        }
+        int n_i = spatial_indicies[range_starts[r_i] + int(offset)];
+        tile_indices[t] = n_i;
+        tile_positions[t] = positions[n_i];
+        if (needs_dynamics) {
+            tile_velocities[t] = velocities[n_i];
+            tile_densities[t] = densities[n_i];
+        }
+    }
+    memoryBarrierShared();
+    barrier();
+
+    for (int i = start + int(local_id); i < end; i += int(local_size)) {
+        int p_i = spatial_indicies[i];
+        bool in_tile = posToCellCoord(positions[p_i]) == tile_cell;
+
+        if (stage == stage_density) {
+            if (in_tile)
+                calcDensityTiled(p_i, tile_size);
+            else
+                calcDensity(p_i);
+            continue;
+        }
+
+        vec2 force = in_tile ? calcFluidForceTiled(p_i, tile_size) : calcFluidForce(p_i);
+        if (stage == stage_forces)
+            forces[p_i] = force;
+        else
+            integrateParticle(p_i, force);
+    }
 }
@@ -0,0 +1,15 @@
+#version 430 core
+
+in vec2 local_uv;
+
+// Accumulated with additive blending into the surface density target.
+out float out_density;
+
+void main() {
+    float r2 = dot(local_uv, local_uv);
+    if (r2 > 1.0)
+        discard;
+    // Poly6 shape, smooth to zero at the edge so the sum has no seams.
+    float w = 1.0 - r2;
+    out_density = w * w * w;
+}
@@ -0,0 +1,52 @@
+#version 430 core
+
+in vec2 uv;
+
+uniform sampler2D density_texture;
+uniform float threshold;
+
+out vec4 out_color;
+
+const vec3 fluid_color = vec3(35.0, 137.0, 218.0) / 255.0;
+const vec3 light_dir = normalize(vec3(-0.4, 0.6, 1.0));
+
+// Tent filter over the low resolution field, on top of bilinear upsampling.
+float smoothedDensity(vec2 p) {
+    vec2 texel = 1.0 / vec2(textureSize(density_texture, 0));
+    float sum = 4.0 * texture(density_texture, p).r;
+    sum += 2.0 * texture(density_texture, p + vec2(texel.x, 0.0)).r;
+    sum += 2.0 * texture(density_texture, p - vec2(texel.x, 0.0)).r;
+    sum += 2.0 * texture(density_texture, p + vec2(0.0, texel.y)).r;
+    sum += 2.0 * texture(density_texture, p - vec2(0.0, texel.y)).r;
+    sum += texture(density_texture, p + texel).r;
+    sum += texture(density_texture, p - texel).r;
+    sum += texture(density_texture, p + vec2(texel.x, -texel.y)).r;
+    sum += texture(density_texture, p + vec2(-texel.x, texel.y)).r;
+    return sum / 16.0;
+}
+
+void main() {
+    float density = smoothedDensity(uv);
+    // Soft edge a little either side of the threshold instead of aliasing.
+    float coverage = smoothstep(0.8 * threshold, 1.2 * threshold, density);
+    if (coverage <= 0.0)
+        discard;
+
+    // Treat the density field as a height map for the normal.
+    vec2 texel = 1.0 / vec2(textureSize(density_texture, 0));
+    float dx = texture(density_texture, uv + vec2(texel.x, 0.0)).r -
+               texture(density_texture, uv - vec2(texel.x, 0.0)).r;
+    float dy = texture(density_texture, uv + vec2(0.0, texel.y)).r -
+               texture(density_texture, uv - vec2(0.0, texel.y)).r;
+    vec3 normal = normalize(vec3(-dx, -dy, 0.5));
+
+    float diffuse = max(dot(normal, light_dir), 0.0);
+    vec3 half_dir = normalize(light_dir + vec3(0.0, 0.0, 1.0));
+    float specular = pow(max(dot(normal, half_dir), 0.0), 32.0);
+    // Deeper (denser) fluid is drawn darker.
+    float depth = clamp(density / (4.0 * threshold), 0.0, 1.0);
+
+    vec3 color = fluid_color * mix(1.0, 0.6, depth) * (0.35 + 0.65 * diffuse);
+    color += vec3(0.6) * specular;
+    out_color = vec4(color, coverage);
+}
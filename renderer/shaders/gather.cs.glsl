@@ -0,0 +1,33 @@
+#version 430 core
+
+// dst[i] = src[permutation[i]] for elements of words_per_element 32 bit
+// words, so any particle attribute buffer can be reordered.
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+
+layout(std430, binding = 0) buffer ssbo1 {
+    uint permutation[];
+};
+
+layout(std430, binding = 1) buffer ssbo2 {
+    uint src[];
+};
+
+layout(std430, binding = 2) buffer ssbo3 {
+    uint dst[];
+};
+
+uniform uint element_count;
+uniform uint words_per_element;
+
+void main() {
+    // Flatten the 2D dispatch, see ComputeShader::executeSyncWorkGroups.
+    uint group = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+    uint i = group * gl_WorkGroupSize.x + gl_LocalInvocationID.x;
+    if (i >= element_count)
+        return;
+
+    uint from = permutation[i] * words_per_element;
+    uint to = i * words_per_element;
+    for (uint w = 0; w < words_per_element; w++)
+        dst[to + w] = src[from + w];
+}
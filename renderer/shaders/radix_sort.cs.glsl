@@ -0,0 +1,187 @@
+#version 430 core
+
+// Least significant digit radix sort of (key, value) pairs, 4 bits per pass.
+// Each pass runs histogram -> scan -> scatter. Keys are processed in blocks
+// of block_size, one work group per block.
+layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;
+
+layout(std430, binding = 0) buffer ssbo1 {
+    uint keys_in[];
+};
+
+layout(std430, binding = 1) buffer ssbo2 {
+    uint values_in[];
+};
+
+layout(std430, binding = 2) buffer ssbo3 {
+    uint keys_out[];
+};
+
+layout(std430, binding = 3) buffer ssbo4 {
+    uint values_out[];
+};
+
+// Digit major: block_histograms[digit * block_count + block]. After the scan
+// each entry is the global offset of that digit in that block.
+layout(std430, binding = 4) buffer ssbo5 {
+    uint block_histograms[];
+};
+
+// Determines which kernel function is actually executed.
+uniform uint kernel_id;
+
+uniform uint key_count;
+uniform uint block_count;
+uniform uint shift;
+
+const uint radix = 16;
+const uint items_per_thread = 4;
+const uint block_size = 256 * items_per_thread;
+
+shared uint local_histogram[radix];
+shared uint thread_digit_counts[radix][256];
+shared uint scan_partials[256];
+
+void initValues(uint block);
+void histogram(uint block);
+void scan();
+void scatter(uint block);
+
+void main() {
+    // Flatten the 2D dispatch, see ComputeShader::executeSyncWorkGroups.
+    uint block = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+
+    if (kernel_id == 0) {
+        initValues(block);
+    }
+    else if (kernel_id == 1) {
+        histogram(block);
+    }
+    else if (kernel_id == 2) {
+        scan();
+    }
+    else if (kernel_id == 3) {
+        scatter(block);
+    }
+}
+
+uint digitOf(uint key) {
+    return (key >> shift) & (radix - 1);
+}
+
+void initValues(uint block) {
+    uint i = block * gl_WorkGroupSize.x + gl_LocalInvocationID.x;
+    if (i < key_count)
+        values_in[i] = i;
+}
+
+void histogram(uint block) {
+    // Uniform per work group so fine before barriers.
+    if (block >= block_count)
+        return;
+
+    uint local_id = gl_LocalInvocationID.x;
+    if (local_id < radix)
+        local_histogram[local_id] = 0;
+    memoryBarrierShared();
+    barrier();
+
+    // Strided so neighbouring invocations read neighbouring keys.
+    for (uint k = 0; k < items_per_thread; k++) {
+        uint i = block * block_size + k * 256 + local_id;
+        if (i < key_count)
+            atomicAdd(local_histogram[digitOf(keys_in[i])], 1);
+    }
+    memoryBarrierShared();
+    barrier();
+
+    if (local_id < radix)
+        block_histograms[local_id * block_count + block] = local_histogram[local_id];
+}
+
+void scan() {
+    // Single work group exclusive scan over all block histograms. Each
+    // invocation owns a contiguous chunk.
+    uint local_id = gl_LocalInvocationID.x;
+    uint total = radix * block_count;
+    uint chunk = (total + 255) / 256;
+    uint chunk_start = min(local_id * chunk, total);
+    uint chunk_end = min(chunk_start + chunk, total);
+
+    uint sum = 0;
+    for (uint i = chunk_start; i < chunk_end; i++)
+        sum += block_histograms[i];
+    scan_partials[local_id] = sum;
+    memoryBarrierShared();
+    barrier();
+
+    if (local_id == 0) {
+        uint running = 0;
+        for (uint i = 0; i < 256; i++) {
+            uint count = scan_partials[i];
+            scan_partials[i] = running;
+            running += count;
+        }
+    }
+    memoryBarrierShared();
+    barrier();
+
+    uint running = scan_partials[local_id];
+    for (uint i = chunk_start; i < chunk_end; i++) {
+        uint count = block_histograms[i];
+        block_histograms[i] = running;
+        running += count;
+    }
+}
+
+void scatter(uint block) {
+    if (block >= block_count)
+        return;
+
+    // Each invocation owns items_per_thread consecutive keys, which together
+    // with the per digit prefix over invocations keeps the sort stable.
+    uint local_id = gl_LocalInvocationID.x;
+    uint first = block * block_size + local_id * items_per_thread;
+
+    for (uint d = 0; d < radix; d++)
+        thread_digit_counts[d][local_id] = 0;
+
+    for (uint k = 0; k < items_per_thread; k++) {
+        uint i = first + k;
+        if (i < key_count)
+            thread_digit_counts[digitOf(keys_in[i])][local_id]++;
+    }
+    memoryBarrierShared();
+    barrier();
+
+    // Exclusive prefix over invocations, one digit per invocation.
+    if (local_id < radix) {
+        uint running = 0;
+        for (uint t = 0; t < 256; t++) {
+            uint count = thread_digit_counts[local_id][t];
+            thread_digit_counts[local_id][t] = running;
+            running += count;
+        }
+    }
+    memoryBarrierShared();
+    barrier();
+
+    uint seen[radix];
+    for (uint d = 0; d < radix; d++)
+        seen[d] = 0;
+
+    for (uint k = 0; k < items_per_thread; k++) {
+        uint i = first + k;
+        if (i >= key_count)
+            break;
+
+        uint key = keys_in[i];
+        uint d = digitOf(key);
+        uint dest = block_histograms[d * block_count + block] +
+                    thread_digit_counts[d][local_id] + seen[d];
+        seen[d]++;
+
+        keys_out[dest] = key;
+        values_out[dest] = values_in[i];
+    }
+}
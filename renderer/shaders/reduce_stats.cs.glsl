@@ -0,0 +1,123 @@
+#version 430 core
+#extension GL_KHR_shader_subgroup_basic : enable
+#extension GL_KHR_shader_subgroup_arithmetic : enable
+
+// Global simulation statistics in two passes: each work group reduces its
+// particles to a partial, then a single work group reduces the partials.
+// Partials hold (max speed^2, density sum, kinetic energy sum, unused).
+layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;
+
+layout(std430, binding = 0) buffer ssbo1 {
+    vec2 velocities[];
+};
+
+layout(std430, binding = 1) buffer ssbo2 {
+    vec2 densities[];
+};
+
+layout(std430, binding = 2) buffer ssbo3 {
+    vec4 partials[];
+};
+
+// Must match SimStats in stats_reduction.hpp.
+layout(std430, binding = 3) buffer ssbo4 {
+    float max_speed;
+    float mean_density;
+    float kinetic_energy;
+    uint stats_particle_count;
+};
+
+// Determines which kernel function is actually executed.
+uniform uint kernel_id;
+
+uniform uint particle_count;
+uniform uint partial_count;
+uniform float particle_mass;
+
+shared vec4 scratch[256];
+
+void reduceParticles(uint group);
+void reducePartials();
+
+void main() {
+    // Flatten the 2D dispatch, see ComputeShader::executeSyncWorkGroups.
+    uint group = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+
+    if (kernel_id == 0) {
+        reduceParticles(group);
+    }
+    else if (kernel_id == 1) {
+        reducePartials();
+    }
+}
+
+vec4 combine(vec4 a, vec4 b) {
+    return vec4(max(a.x, b.x), a.y + b.y, a.z + b.z, 0.0);
+}
+
+// Reduce one value per invocation to a single value in invocation 0.
+vec4 reduceWorkGroup(vec4 value) {
+    uint local_id = gl_LocalInvocationID.x;
+
+#if defined(GL_KHR_shader_subgroup_basic) && defined(GL_KHR_shader_subgroup_arithmetic)
+    // Reduce within each subgroup in registers, then across subgroup leaders.
+    vec4 subgroup_value = vec4(subgroupMax(value.x), subgroupAdd(value.y),
+                               subgroupAdd(value.z), 0.0);
+    if (subgroupElect())
+        scratch[gl_SubgroupID] = subgroup_value;
+    memoryBarrierShared();
+    barrier();
+
+    vec4 result = scratch[0];
+    if (local_id == 0) {
+        for (uint i = 1; i < gl_NumSubgroups; i++)
+            result = combine(result, scratch[i]);
+    }
+    return result;
+#else
+    // Shared memory tree.
+    scratch[local_id] = value;
+    memoryBarrierShared();
+    barrier();
+
+    for (uint stride = gl_WorkGroupSize.x / 2; stride > 0; stride /= 2) {
+        if (local_id < stride)
+            scratch[local_id] = combine(scratch[local_id], scratch[local_id + stride]);
+        memoryBarrierShared();
+        barrier();
+    }
+    return scratch[0];
+#endif
+}
+
+void reduceParticles(uint group) {
+    if (group >= partial_count)
+        return;
+
+    uint p_i = group * gl_WorkGroupSize.x + gl_LocalInvocationID.x;
+
+    // Out of range invocations contribute the identity.
+    vec4 value = vec4(0.0);
+    if (p_i < particle_count) {
+        float speed2 = dot(velocities[p_i], velocities[p_i]);
+        value = vec4(speed2, densities[p_i][0], 0.5 * particle_mass * speed2, 0.0);
+    }
+
+    vec4 result = reduceWorkGroup(value);
+    if (gl_LocalInvocationID.x == 0)
+        partials[group] = result;
+}
+
+void reducePartials() {
+    vec4 value = vec4(0.0);
+    for (uint i = gl_LocalInvocationID.x; i < partial_count; i += gl_WorkGroupSize.x)
+        value = combine(value, partials[i]);
+
+    vec4 result = reduceWorkGroup(value);
+    if (gl_LocalInvocationID.x == 0) {
+        max_speed = sqrt(result.x);
+        mean_density = result.y / float(max(particle_count, 1u));
+        kinetic_energy = result.z;
+        stats_particle_count = particle_count;
+    }
+}
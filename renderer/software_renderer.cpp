@@ -0,0 +1,330 @@
+#include "software_renderer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+
+#include <glm/geometric.hpp>
+
+namespace {
+
+// Same rounding as GL's float to unorm8 conversion.
+uint32_t packColour(const glm::vec3 colour) {
+  const glm::vec3 c = glm::clamp(colour, 0.f, 1.f) * 255.f + 0.5f;
+  return (uint32_t)c.r | (uint32_t)c.g << 8 | (uint32_t)c.b << 16 |
+         0xffu << 24;
+}
+
+glm::vec3 unpackColour(const uint32_t colour) {
+  return glm::vec3(colour & 0xff, colour >> 8 & 0xff, colour >> 16 & 0xff) /
+         255.f;
+}
+
+} // namespace
+
+SoftwareRenderer::SoftwareRenderer(const uint32_t _width,
+                                   const uint32_t _height)
+    : width(_width), height(_height),
+      tiles_x((_width + tile_size - 1) / tile_size),
+      tiles_y((_height + tile_size - 1) / tile_size),
+      pixels((size_t)_width * _height) {
+  this->thread_count = std::max(1u, std::thread::hardware_concurrency());
+  this->bins.resize(this->thread_count);
+}
+
+template <typename F>
+void SoftwareRenderer::parallelFor(const uint32_t count, F func) {
+  // Items are handed out one at a time, tiles vary a lot in cost.
+  std::atomic<uint32_t> next(0);
+  std::vector<std::thread> threads;
+  const uint32_t used_threads = std::min(this->thread_count, count);
+  for (uint32_t t = 0; t < used_threads; t++) {
+    threads.emplace_back([t, count, &next, &func]() {
+      for (uint32_t i = next++; i < count; i = next++) {
+        func(i, t);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+void SoftwareRenderer::render(const Particles &particles,
+                              const float particle_radius,
+                              const float smoothing_radius,
+                              const Camera &camera) {
+  this->render(particles.positions, particles.species, particle_radius,
+               smoothing_radius, camera);
+}
+
+void SoftwareRenderer::render(const std::vector<glm::vec2> &positions,
+                              const std::vector<uint8_t> &species,
+                              const float particle_radius,
+                              const float smoothing_radius,
+                              const Camera &camera) {
+  if (this->fluid_surface) {
+    this->splatDensity(positions, smoothing_radius, camera);
+    this->shadeSurface();
+  } else {
+    this->rasteriseCircles(positions, species, particle_radius, camera);
+  }
+}
+
+uint32_t SoftwareRenderer::binParticles(const std::vector<glm::vec2> &positions,
+                                        const glm::vec2 radius,
+                                        const Camera &camera,
+                                        const glm::ivec2 target_size) {
+  const glm::ivec2 tiles = (target_size + (int32_t)tile_size - 1) /
+                           (int32_t)tile_size;
+  const glm::vec2 view_min = camera.visibleMin();
+  const glm::vec2 to_pixels =
+      glm::vec2(target_size) / (camera.visibleMax() - view_min);
+  const uint32_t count = positions.size();
+  const uint32_t chunk =
+      (count + this->thread_count - 1) / this->thread_count;
+
+  // Static slices here, unlike parallelFor, to keep each bin in order.
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < this->thread_count; t++) {
+    threads.emplace_back([&, t]() {
+      std::vector<std::vector<int32_t>> &thread_bins = this->bins[t];
+      thread_bins.resize(tiles.x * tiles.y);
+      for (std::vector<int32_t> &bin : thread_bins) {
+        bin.clear();
+      }
+      const uint32_t end = std::min((t + 1) * chunk, count);
+      for (uint32_t p_i = t * chunk; p_i < end; p_i++) {
+        const glm::vec2 centre = (positions[p_i] - view_min) * to_pixels;
+        const glm::vec2 extent = radius * to_pixels;
+        const glm::ivec2 min_tile =
+            glm::ivec2(glm::floor((centre - extent) / (float)tile_size));
+        const glm::ivec2 max_tile =
+            glm::ivec2(glm::floor((centre + extent) / (float)tile_size));
+        if (max_tile.x < 0 || max_tile.y < 0 || min_tile.x >= tiles.x ||
+            min_tile.y >= tiles.y)
+          continue;
+        const glm::ivec2 lo = glm::max(min_tile, glm::ivec2(0));
+        const glm::ivec2 hi = glm::min(max_tile, tiles - 1);
+        for (int32_t y = lo.y; y <= hi.y; y++) {
+          for (int32_t x = lo.x; x <= hi.x; x++) {
+            thread_bins[y * tiles.x + x].push_back(p_i);
+          }
+        }
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return tiles.x;
+}
+
+void SoftwareRenderer::rasteriseCircles(const std::vector<glm::vec2> &positions,
+                                        const std::vector<uint8_t> &species,
+                                        const float particle_radius,
+                                        const Camera &camera) {
+  const glm::ivec2 size(this->width, this->height);
+  this->binParticles(positions, glm::vec2(particle_radius), camera, size);
+
+  const glm::vec2 view_min = camera.visibleMin();
+  const glm::vec2 to_pixels = glm::vec2(size) / (camera.visibleMax() - view_min);
+  // Ellipse in pixels when the view and viewport aspect ratios differ,
+  // exactly like the stretched quads in GL.
+  const glm::vec2 radius = particle_radius * to_pixels;
+  std::vector<uint32_t> palette_colours(this->palette.size());
+  std::transform(this->palette.begin(), this->palette.end(),
+                 palette_colours.begin(), packColour);
+  const uint32_t clear = packColour(this->clear_colour);
+
+  this->parallelFor(this->tiles_x * this->tiles_y, [&](uint32_t tile,
+                                                       uint32_t) {
+    const glm::ivec2 tile_min(tile % this->tiles_x * tile_size,
+                              tile / this->tiles_x * tile_size);
+    const glm::ivec2 tile_max =
+        glm::min(tile_min + (int32_t)tile_size, size) - 1;
+    for (int32_t y = tile_min.y; y <= tile_max.y; y++) {
+      uint32_t *row = &this->pixels[(size_t)y * this->width];
+      std::fill(row + tile_min.x, row + tile_max.x + 1, clear);
+    }
+
+    for (const std::vector<std::vector<int32_t>> &thread_bins : this->bins) {
+      for (const int32_t p_i : thread_bins[tile]) {
+        const glm::vec2 centre = (positions[p_i] - view_min) * to_pixels;
+        const uint32_t colour =
+            palette_colours[std::min<size_t>(species[p_i],
+                                             palette_colours.size() - 1)];
+        // Pixel centres inside the circle, the test the fragment shader
+        // does on the interpolated quad uv.
+        auto inside = [&](const int32_t x, const float dy2) {
+          const float dx = (x + 0.5f - centre.x) / radius.x;
+          return dx * dx + dy2 <= 1.f;
+        };
+        const int32_t y0 = std::max(
+            tile_min.y, (int32_t)std::ceil(centre.y - radius.y - 0.5f));
+        const int32_t y1 = std::min(
+            tile_max.y, (int32_t)std::floor(centre.y + radius.y - 0.5f));
+        for (int32_t y = y0; y <= y1; y++) {
+          const float dy = (y + 0.5f - centre.y) / radius.y;
+          const float dy2 = dy * dy;
+          if (dy2 > 1.f)
+            continue;
+          // Solve for the covered span once per row, then nudge its ends
+          // onto the exact per pixel test, so the body is a plain fill.
+          const float half_span = radius.x * std::sqrt(1.f - dy2);
+          int32_t x0 = (int32_t)std::ceil(centre.x - half_span - 0.5f);
+          int32_t x1 = (int32_t)std::floor(centre.x + half_span - 0.5f);
+          if (inside(x0 - 1, dy2))
+            x0--;
+          else if (!inside(x0, dy2))
+            x0++;
+          if (inside(x1 + 1, dy2))
+            x1++;
+          else if (!inside(x1, dy2))
+            x1--;
+          x0 = std::max(x0, tile_min.x);
+          x1 = std::min(x1, tile_max.x);
+          if (x0 > x1)
+            continue;
+          uint32_t *row = &this->pixels[(size_t)y * this->width];
+          std::fill(row + x0, row + x1 + 1, colour);
+        }
+      }
+    }
+  });
+}
+
+void SoftwareRenderer::splatDensity(const std::vector<glm::vec2> &positions,
+                                    const float smoothing_radius,
+                                    const Camera &camera) {
+  const glm::ivec2 size = glm::max(
+      glm::ivec2(glm::vec2(this->width, this->height) *
+                 this->surface_resolution_scale),
+      glm::ivec2(1));
+  this->density_size = size;
+  this->density.assign((size_t)size.x * size.y, 0.f);
+  const uint32_t tiles_x =
+      this->binParticles(positions, glm::vec2(smoothing_radius), camera, size);
+  const uint32_t tiles_y = (size.y + tile_size - 1) / tile_size;
+
+  const glm::vec2 view_min = camera.visibleMin();
+  const glm::vec2 to_pixels = glm::vec2(size) / (camera.visibleMax() - view_min);
+  const glm::vec2 radius = smoothing_radius * to_pixels;
+
+  this->parallelFor(tiles_x * tiles_y, [&](uint32_t tile, uint32_t) {
+    const glm::ivec2 tile_min(tile % tiles_x * tile_size,
+                              tile / tiles_x * tile_size);
+    const glm::ivec2 tile_max = glm::min(tile_min + (int32_t)tile_size, size) - 1;
+    for (const std::vector<std::vector<int32_t>> &thread_bins : this->bins) {
+      for (const int32_t p_i : thread_bins[tile]) {
+        const glm::vec2 centre = (positions[p_i] - view_min) * to_pixels;
+        const glm::ivec2 lo = glm::max(
+            tile_min, glm::ivec2(glm::ceil(centre - radius - 0.5f)));
+        const glm::ivec2 hi = glm::min(
+            tile_max, glm::ivec2(glm::floor(centre + radius - 0.5f)));
+        for (int32_t y = lo.y; y <= hi.y; y++) {
+          const float dy = (y + 0.5f - centre.y) / radius.y;
+          float *row = &this->density[(size_t)y * size.x];
+          // Branch free so the row vectorises, outside the kernel w is 0.
+          for (int32_t x = lo.x; x <= hi.x; x++) {
+            const float dx = (x + 0.5f - centre.x) / radius.x;
+            const float w = std::max(1.f - dx * dx - dy * dy, 0.f);
+            row[x] += w * w * w;
+          }
+        }
+      }
+    }
+  });
+}
+
+float SoftwareRenderer::sampleDensity(const glm::vec2 uv) {
+  // Bilinear with clamp to edge, texel centres at half integers.
+  const glm::vec2 p = uv * glm::vec2(this->density_size) - 0.5f;
+  const glm::vec2 f = p - glm::floor(p);
+  const glm::ivec2 i0 =
+      glm::clamp(glm::ivec2(glm::floor(p)), glm::ivec2(0), this->density_size - 1);
+  const glm::ivec2 i1 = glm::min(glm::ivec2(glm::floor(p)) + 1,
+                                 this->density_size - 1);
+  auto at = [&](const int32_t x, const int32_t y) {
+    return this->density[(size_t)y * this->density_size.x + x];
+  };
+  const float bottom = glm::mix(at(i0.x, i0.y), at(i1.x, i0.y), f.x);
+  const float top = glm::mix(at(i0.x, i1.y), at(i1.x, i1.y), f.x);
+  return glm::mix(bottom, top, f.y);
+}
+
+void SoftwareRenderer::shadeSurface() {
+  // Port of fluid_surface.fs.glsl, blended over the clear colour.
+  const glm::vec3 fluid_colour = this->palette[0];
+  const glm::vec3 light_dir = glm::normalize(glm::vec3(-0.4f, 0.6f, 1.f));
+  const glm::vec3 half_dir = glm::normalize(light_dir + glm::vec3(0.f, 0.f, 1.f));
+  const glm::vec2 texel = 1.f / glm::vec2(this->density_size);
+  const float threshold = this->surface_threshold;
+  const uint32_t clear = packColour(this->clear_colour);
+  // GL blends over the already quantised clear colour.
+  const glm::vec3 background = unpackColour(clear);
+
+  this->parallelFor(this->height, [&](uint32_t y, uint32_t) {
+    uint32_t *row = &this->pixels[(size_t)y * this->width];
+    for (uint32_t x = 0; x < this->width; x++) {
+      const glm::vec2 uv((x + 0.5f) / this->width, (y + 0.5f) / this->height);
+      float density = 4.f * this->sampleDensity(uv);
+      density += 2.f * this->sampleDensity(uv + glm::vec2(texel.x, 0.f));
+      density += 2.f * this->sampleDensity(uv - glm::vec2(texel.x, 0.f));
+      density += 2.f * this->sampleDensity(uv + glm::vec2(0.f, texel.y));
+      density += 2.f * this->sampleDensity(uv - glm::vec2(0.f, texel.y));
+      density += this->sampleDensity(uv + texel);
+      density += this->sampleDensity(uv - texel);
+      density += this->sampleDensity(uv + glm::vec2(texel.x, -texel.y));
+      density += this->sampleDensity(uv + glm::vec2(-texel.x, texel.y));
+      density /= 16.f;
+
+      const float coverage =
+          glm::smoothstep(0.8f * threshold, 1.2f * threshold, density);
+      if (coverage <= 0.f) {
+        row[x] = clear;
+        continue;
+      }
+
+      const float dx = this->sampleDensity(uv + glm::vec2(texel.x, 0.f)) -
+                       this->sampleDensity(uv - glm::vec2(texel.x, 0.f));
+      const float dy = this->sampleDensity(uv + glm::vec2(0.f, texel.y)) -
+                       this->sampleDensity(uv - glm::vec2(0.f, texel.y));
+      const glm::vec3 normal = glm::normalize(glm::vec3(-dx, -dy, 0.5f));
+      const float diffuse = std::max(glm::dot(normal, light_dir), 0.f);
+      const float specular =
+          std::pow(std::max(glm::dot(normal, half_dir), 0.f), 32.f);
+      const float depth = glm::clamp(density / (4.f * threshold), 0.f, 1.f);
+
+      glm::vec3 colour = fluid_colour * glm::mix(1.f, 0.6f, depth) *
+                         (0.35f + 0.65f * diffuse);
+      colour += glm::vec3(0.6f) * specular;
+      row[x] = packColour(
+          glm::mix(background, glm::clamp(colour, 0.f, 1.f), coverage));
+    }
+  });
+}
+
+bool SoftwareRenderer::writePpm(const std::string &path) {
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    std::cerr << "Failed to write frame: " << path << "\n";
+    return false;
+  }
+  fprintf(file, "P6\n%u %u\n255\n", this->width, this->height);
+  std::vector<uint8_t> rgb((size_t)this->width * 3);
+  for (uint32_t y = 0; y < this->height; y++) {
+    const uint32_t *row = &this->pixels[(size_t)(this->height - 1 - y) * this->width];
+    for (uint32_t x = 0; x < this->width; x++) {
+      rgb[x * 3] = row[x] & 0xff;
+      rgb[x * 3 + 1] = row[x] >> 8 & 0xff;
+      rgb[x * 3 + 2] = row[x] >> 16 & 0xff;
+    }
+    fwrite(rgb.data(), 1, rgb.size(), file);
+  }
+  fclose(file);
+  return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "../physics/particles.hpp"
+#include "camera.hpp"
+
+// Host rasteriser producing the same frames as Renderer, for machines
+// without a GPU. Particles are binned into screen tiles, then threads take
+// whole tiles so no two of them ever write the same pixel. Bins keep
+// particle order, so later particles cover earlier ones as in GL.
+struct SoftwareRenderer {
+  static const uint32_t tile_size = 64;
+
+  uint32_t width;
+  uint32_t height;
+  uint32_t thread_count;
+  uint32_t tiles_x;
+  uint32_t tiles_y;
+
+  std::vector<glm::vec3> palette = {glm::vec3(35.f, 137.f, 218.f) / 255.f};
+  glm::vec3 clear_colour = glm::vec3(0.9f);
+  // Same options and defaults as the GL screen space fluid surface.
+  bool fluid_surface = false;
+  float surface_resolution_scale = 0.25f;
+  float surface_threshold = 0.6f;
+
+  // RGBA8 as uint32 per pixel, rows bottom to top like glReadPixels.
+  std::vector<uint32_t> pixels;
+  // Particle indices per thread, per tile. Each thread bins a contiguous
+  // slice of particles, so walking threads in order keeps draw order.
+  std::vector<std::vector<std::vector<int32_t>>> bins;
+  // Splatted kernel sum at surface resolution, rows bottom to top.
+  std::vector<float> density;
+  glm::ivec2 density_size = glm::ivec2(0);
+
+  SoftwareRenderer(const uint32_t _width, const uint32_t _height);
+
+  void render(const std::vector<glm::vec2> &positions,
+              const std::vector<uint8_t> &species, const float particle_radius,
+              const float smoothing_radius, const Camera &camera);
+
+  void render(const Particles &particles, const float particle_radius,
+              const float smoothing_radius, const Camera &camera);
+
+  // Bin particles whose radius-sized square overlaps a tile of a target
+  // of size target_size, returns the tile count along x.
+  uint32_t binParticles(const std::vector<glm::vec2> &positions,
+                        const glm::vec2 radius, const Camera &camera,
+                        const glm::ivec2 target_size);
+
+  void rasteriseCircles(const std::vector<glm::vec2> &positions,
+                        const std::vector<uint8_t> &species,
+                        const float particle_radius, const Camera &camera);
+
+  void splatDensity(const std::vector<glm::vec2> &positions,
+                    const float smoothing_radius, const Camera &camera);
+
+  void shadeSurface();
+
+  float sampleDensity(const glm::vec2 uv);
+
+  bool writePpm(const std::string &path);
+
+  template <typename F> void parallelFor(const uint32_t count, F func);
+};
@@ -0,0 +1,106 @@
+#pragma once
+#include <glad/glad.h>
+#include <cstdint>
+#include "compute_shader.hpp"
+
+// Must match the stats block in reduce_stats.cs.glsl.
+struct SimStats {
+  float max_speed;
+  float mean_density;
+  float kinetic_energy;
+  uint32_t particle_count;
+};
+
+// Reduces particle state to a SimStats SSBO on the GPU every step. Later
+// dispatches can bind statsBuffer() directly, the host gets a copy through an
+// asynchronous fenced readback instead of reading whole particle arrays.
+class StatsReduction {
+public:
+  StatsReduction() : shader("./renderer/shaders/reduce_stats.cs.glsl") {
+    glGenBuffers(1, &this->partials);
+    glGenBuffers(1, &this->stats);
+    glGenBuffers(1, &this->readback);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->stats);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(SimStats), NULL,
+                 GL_DYNAMIC_COPY);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, this->readback);
+    glBufferData(GL_COPY_WRITE_BUFFER, sizeof(SimStats), NULL,
+                 GL_STREAM_READ);
+  }
+
+  void reduce(const uint32_t velocities_ssbo, const uint32_t densities_ssbo,
+              const uint32_t particle_count, const float particle_mass) {
+    const uint32_t group_size = 256;
+    const uint32_t partial_count = (particle_count + group_size - 1) / group_size;
+    if (partial_count > this->partial_capacity) {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->partials);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * 4 * partial_count,
+                   NULL, GL_DYNAMIC_COPY);
+      this->partial_capacity = partial_count;
+    }
+
+    const uint32_t reduce_particles_kernel_id = 0;
+    const uint32_t reduce_partials_kernel_id = 1;
+
+    this->shader.use();
+    this->shader.bindBuffer(velocities_ssbo, 0);
+    this->shader.bindBuffer(densities_ssbo, 1);
+    this->shader.bindBuffer(this->partials, 2);
+    this->shader.bindBuffer(this->stats, 3);
+    this->shader.setUnsignedInt(particle_count, "particle_count");
+    this->shader.setUnsignedInt(partial_count, "partial_count");
+    this->shader.setFloat(particle_mass, "particle_mass");
+
+    this->shader.setUnsignedInt(reduce_particles_kernel_id, "kernel_id");
+    this->shader.executeSyncWorkGroups(partial_count);
+
+    this->shader.setUnsignedInt(reduce_partials_kernel_id, "kernel_id");
+    this->shader.executeSyncWorkGroups(1);
+
+    // Queue a copy for the host unless the last one is still in flight.
+    if (this->fence == NULL) {
+      glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+      glBindBuffer(GL_COPY_READ_BUFFER, this->stats);
+      glBindBuffer(GL_COPY_WRITE_BUFFER, this->readback);
+      glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                          sizeof(SimStats));
+      this->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+  }
+
+  // Non blocking, returns true and fills stats once a queued copy landed.
+  bool fetch(SimStats &destination) {
+    if (this->fence == NULL)
+      return false;
+
+    GLenum status = glClientWaitSync(this->fence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+      return false;
+
+    glDeleteSync(this->fence);
+    this->fence = NULL;
+    glBindBuffer(GL_COPY_READ_BUFFER, this->readback);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(SimStats), &destination);
+    return true;
+  }
+
+  // Latest stats on the GPU, for consumption by later dispatches.
+  uint32_t statsBuffer() const { return this->stats; }
+
+  ~StatsReduction() {
+    if (this->fence != NULL)
+      glDeleteSync(this->fence);
+    glDeleteBuffers(1, &this->partials);
+    glDeleteBuffers(1, &this->stats);
+    glDeleteBuffers(1, &this->readback);
+  }
+
+private:
+  ComputeShader shader;
+  uint32_t partials;
+  uint32_t stats;
+  uint32_t readback;
+  uint32_t partial_capacity = 0;
+  GLsync fence = NULL;
+};
@@ -1,2 +1,6 @@
-g++ -g main.cpp physics/spatial_grid.cpp physics/particles.cpp physics/physics.cpp renderer/renderer.cpp -Iinclude glad.c -ldl -lglfw
+# Pass "opencl" to also build the OpenCL backend (e.g. POCL on the CPU).
+if [ "$1" = "opencl" ]; then
+  OPENCL_FLAGS="-DUSE_OPENCL physics/gpu_compute.cpp -lOpenCL"
+fi
+g++ -g main.cpp physics/spatial_grid.cpp physics/particles.cpp physics/physics.cpp physics/cpu_compute.cpp physics/surface_extractor.cpp physics/checkpoint.cpp physics/trajectory_writer.cpp renderer/renderer.cpp renderer/software_renderer.cpp -Iinclude glad.c -ldl -lglfw -lpthread $OPENCL_FLAGS
 ./a.out